@@ -0,0 +1,71 @@
+#define _POSIX_C_SOURCE 200809L     /* clock_gettime() */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "structures.h"
+
+/* Inserts 100k newlines at the start of a 1M-line buffer, through the
+   rope and through a flat array of lines kept the way the buffer used to
+   be: realloc, memmove, and renumber every later line. */
+
+#define LINES 1000000
+#define INSERTS 100000
+#define FLAT_INSERTS 1000   /* the array is too slow for all of them */
+
+void buffer_insert_line(int at, char *s, size_t len);
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC,&t);
+    return t.tv_sec+t.tv_nsec/1e9;
+}
+
+struct flat_line {
+    int idx;
+    int size;
+    char *chars;
+};
+
+struct flat {
+    struct flat_line *lines;
+    int numlines;
+};
+
+static void flat_insert_line(struct flat *f, int at, char *s, size_t len) {
+    f->lines = realloc(f->lines,sizeof(struct flat_line)*(f->numlines+1));
+    if (at != f->numlines) {
+        memmove(f->lines+at+1,f->lines+at,sizeof(f->lines[0])*(f->numlines-at));
+        for (int j = at+1; j <= f->numlines; j++) f->lines[j].idx++;
+    }
+    struct flat_line *line = f->lines+at;
+    line->idx = at;
+    line->size = len;
+    line->chars = malloc(len+1);
+    memcpy(line->chars,s,len);
+    line->chars[len] = '\0';
+    f->numlines++;
+}
+
+int main(void) {
+    char *text = "int x = 1; /* line */";
+    size_t len = strlen(text);
+
+    struct flat f = {NULL, 0};
+    for (int j = 0; j < LINES; j++) flat_insert_line(&f,f.numlines,text,len);
+    double t0 = now();
+    for (int j = 0; j < FLAT_INSERTS; j++) flat_insert_line(&f,0,"",0);
+    double flat = (now()-t0)/FLAT_INSERTS;
+
+    for (int j = 0; j < LINES; j++) buffer_insert_line(E.buffer.numlines,text,len);
+    t0 = now();
+    for (int j = 0; j < INSERTS; j++) buffer_insert_line(0,"",0);
+    double rope = (now()-t0)/INSERTS;
+
+    printf("%d newlines at the start of %d lines:\n", INSERTS, LINES);
+    printf("  array %10.2f us/insert %9.2f s (from %d of them)\n", flat*1e6, flat*INSERTS, FLAT_INSERTS);
+    printf("  rope  %10.2f us/insert %9.2f s\n", rope*1e6, rope*INSERTS);
+    printf("  speedup %.0fx\n", flat/rope);
+    return 0;
+}
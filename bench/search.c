@@ -0,0 +1,110 @@
+#define _GNU_SOURCE     /* memmem() */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "search.h"
+
+/* Runs each needle through 128MB of generated log lines, counting every
+   match, with search_forward(), memmem() and a loop memcmp'ing at every
+   position.  Needles go from one that never matches to one byte common
+   enough that the per-match cost shows. */
+
+#define SIZE (128<<20)
+#define CHECKS 200000   /* random small haystacks checked against the loop */
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC,&t);
+    return t.tv_sec+t.tv_nsec/1e9;
+}
+
+static const char *naive(const char *s, size_t n, const char *needle, size_t m) {
+    if (m > n) return NULL;
+    for (size_t j = 0; j+m <= n; j++)
+        if (!memcmp(s+j,needle,m)) return s+j;
+    return NULL;
+}
+
+static const char *naive_last(const char *s, size_t n, const char *needle, size_t m) {
+    if (m > n) return NULL;
+    for (size_t j = n-m+1; j-- > 0;)
+        if (!memcmp(s+j,needle,m)) return s+j;
+    return NULL;
+}
+
+static const char *libc(const char *s, size_t n, const char *needle, size_t m) {
+    return memmem(s,n,needle,m);
+}
+
+static char *logfile(size_t size) {
+    static const char *level[] = {"INFO", "DEBUG", "WARN", "ERROR"};
+    static const char *what[] = {"request served", "cache miss", "retrying",
+                                 "connection reset by peer", "timeout"};
+    char *s = malloc(size);
+    size_t n = 0;
+    srand(1);
+    while (n < size) {
+        char line[160];
+        int len = snprintf(line,sizeof(line),
+                           "2024-05-%02d 12:%02d:%02d %s worker=%d request_id=%08x %s\n",
+                           1+rand()%28, rand()%60, rand()%60, level[rand()%4],
+                           rand()%64, (unsigned) rand(), what[rand()%5]);
+        if (n+len > size) len = size-n;
+        memcpy(s+n,line,len);
+        n += len;
+    }
+    return s;
+}
+
+static int check(void) {
+    char s[300], needle[8];
+    srand(2);
+    for (int j = 0; j < CHECKS; j++) {
+        int n = rand()%200, m = 1+rand()%6;
+        for (int k = 0; k < n; k++) s[k] = "abc"[rand()%3];
+        for (int k = 0; k < m; k++) needle[k] = "abc"[rand()%3];
+        if (search_forward(s,n,needle,m) != naive(s,n,needle,m) ||
+            search_backward(s,n,needle,m) != naive_last(s,n,needle,m)) {
+            printf("search differs from the naive loop on %.*s in %.*s\n", m, needle, n, s);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static double run(const char *(*f)(const char *, size_t, const char *, size_t),
+                  const char *s, size_t n, const char *needle, long *hits) {
+    size_t m = strlen(needle);
+    const char *p = s;
+    double t0 = now();
+    *hits = 0;
+    while ((p = f(p,n-(p-s),needle,m))) {
+        (*hits)++;
+        p++;
+    }
+    return n/(now()-t0)/1e9;
+}
+
+int main(void) {
+    static const char *needles[] = {"zzqzz", "request_id=deadbeef", "ERROR worker=7 ", "e"};
+
+    if (!check()) return 1;
+    char *s = logfile(SIZE);
+    printf("%d MB of log lines, GB/s:\n", SIZE>>20);
+    printf("  %-22s %8s %8s %8s %10s\n", "needle", "search", "memmem", "loop", "matches");
+    for (size_t j = 0; j < sizeof(needles)/sizeof(needles[0]); j++) {
+        long hits, h;
+        double fwd = run(search_forward,s,SIZE,needles[j],&hits);
+        double mem = run(libc,s,SIZE,needles[j],&h);
+        double loop = h == hits ? run(naive,s,SIZE,needles[j],&h) : 0;
+        if (h != hits) {
+            printf("search finds %ld matches of %s, memmem or the loop %ld\n", hits, needles[j], h);
+            return 1;
+        }
+        printf("  %-22s %8.2f %8.2f %8.2f %10ld\n", needles[j], fwd, mem, loop, hits);
+    }
+    free(s);
+    return 0;
+}
@@ -0,0 +1,240 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "structures.h"
+#include "slab.h"
+#include "chunk.h"
+
+/* =========================== Long lines ===========================
+ *
+ * A line of CHUNK_LINE chars or more, say minified JSON, is not edited
+ * in place: a keystroke would move the rest of it and render and
+ * highlight it all again.  It gets a table of chunks of up to CHUNK_SIZE
+ * chars instead, with the column each starts at.
+ *
+ * At first every chunk points into line->chars, which stay as they are.
+ * A chunk is copied to a block of its own when first edited, and split
+ * in two when it grows past CHUNK_SIZE, so an edit touches one chunk and
+ * the columns of the chunks after it.  line->size is kept up to date,
+ * line->chars are not: code that needs the line in one piece has
+ * chunk_rebase() copy it back first (see buffer_compact_line()), and the
+ * chunks then point into that copy.  A save thus never sees a chunk
+ * change under it, as chunks only ever point into chars that a save may
+ * share.  The render column and highlighter state of each chunk are
+ * kept in the table too, see highlights.c.
+ */
+
+#define CHUNK_FILL (CHUNK_SIZE*3/4)   /* a chunk split up is cut in pieces this long */
+
+#define TAB 9
+
+static size_t chunk__bytes(int cap) {
+    return sizeof(struct chunks) + sizeof(struct chunk)*cap;
+}
+
+/* Room for <more> chunks past the <n> of the table of <line> */
+static struct chunks *chunk__reserve(struct line *line, int more) {
+    struct chunks *ch = line->chunks;
+    if (ch->n+more <= ch->cap) return ch;
+    int cap = ch->cap*2 > ch->n+more ? ch->cap*2 : ch->n+more;
+    struct chunks *grown = slab_alloc(&E.buffer.store,chunk__bytes(cap));
+    memcpy(grown,ch,chunk__bytes(ch->n));
+    grown->cap = cap;
+    slab_free(&E.buffer.store,ch,chunk__bytes(ch->cap));
+    return line->chunks = grown;
+}
+
+static void chunk__tabs(struct chunks *ch, int k) {
+    struct chunk *c = ch->c+k;
+    ch->tabs -= c->tabs;
+    c->tabs = memchr(c->chars,TAB,c->size) != NULL;
+    ch->tabs += c->tabs;
+}
+
+/* Chunks <k>..<k+m> are new or changed: the entries worked out from them,
+   or from chunks before whose lookahead reaches them, are not right now */
+static void chunk__changed(struct chunks *ch, int k, int m) {
+    int j = k;
+    while (j > 0 && ch->c[k].col - ch->c[j-1].col - ch->c[j-1].size < CHUNK_LOOKAHEAD) j--;
+    if (ch->dirty <= ch->valid || ch->dirty < k+m) ch->dirty = k+m;
+    if (ch->valid > j+1) ch->valid = j+1;
+}
+
+/* Make chunk <k> a block of its own to change */
+static void chunk__own(struct chunks *ch, int k) {
+    struct chunk *c = ch->c+k;
+    if (c->cap) return;
+    char *chars = slab_alloc(&E.buffer.store,CHUNK_SIZE);
+    memcpy(chars,c->chars,c->size);
+    c->chars = chars;
+    c->cap = slab_size(CHUNK_SIZE);
+}
+
+/* Remove chunk <k>: the entries of those after it move along with them */
+static void chunk__drop(struct chunks *ch, int k) {
+    struct chunk *c = ch->c+k;
+    if (c->cap) slab_free(&E.buffer.store,c->chars,c->cap);
+    ch->tabs -= c->tabs;
+    if (ch->dirty > k) ch->dirty--;
+    chunk__changed(ch,k,0);
+    if (ch->known > (k ? k : 1)) ch->known--;
+    if (k == 0) {
+        /* the next chunk starts the line now */
+        ch->c[1].hl = c->hl;
+        ch->c[1].rcol = 0;
+    }
+    memmove(c,c+1,sizeof(struct chunk)*(ch->n-k-1));
+    ch->n--;
+}
+
+/* Columns of the chunks from <k> on, after a change to those before */
+static void chunk__cols(struct chunks *ch, int k) {
+    if (k == 0) ch->c[k++].col = 0;
+    for (; k < ch->n; k++) ch->c[k].col = ch->c[k-1].col+ch->c[k-1].size;
+}
+
+/* Split the chars of <line> into chunks, pointing into them */
+void chunk_line(struct line *line) {
+    int n = line->size ? (line->size+CHUNK_SIZE-1)/CHUNK_SIZE : 1;
+    struct chunks *ch = line->chunks = slab_alloc(&E.buffer.store,chunk__bytes(n));
+    memset(ch,0,chunk__bytes(n));
+    ch->n = ch->cap = n;
+    ch->valid = ch->known = 1;
+    ch->flat = 1;
+    for (int k = 0; k < n; k++) {
+        struct chunk *c = ch->c+k;
+        c->col = k*CHUNK_SIZE;
+        c->chars = line->chars+c->col;
+        c->size = line->size-c->col < CHUNK_SIZE ? line->size-c->col : CHUNK_SIZE;
+        c->tabs = memchr(c->chars,TAB,c->size) != NULL;
+        ch->tabs += c->tabs;
+    }
+}
+
+/* Index of the chunk holding column <col> */
+int chunk_find(struct chunks *ch, int col) {
+    int lo = 0, hi = ch->n-1;
+    while (lo < hi) {
+        int mid = hi - (hi-lo)/2;
+        if (ch->c[mid].col <= col) lo = mid;
+        else hi = mid-1;
+    }
+    return lo;
+}
+
+/* Chars of <line> from column <col> on, *n of them in one piece */
+const char *chunk_span(struct line *line, int col, int *n) {
+    if (!line->chunks) {
+        *n = line->size-col;
+        return line->chars+col;
+    }
+    struct chunk *c = line->chunks->c+chunk_find(line->chunks,col);
+    *n = c->size-(col-c->col);
+    return c->chars+(col-c->col);
+}
+
+/* Put s[0..len) in chunk <k> at <off>, splitting it if it gets too long */
+static void chunk__insert(struct line *line, int k, int off, const char *s, int len) {
+    struct chunks *ch = line->chunks;
+    struct chunk *c = ch->c+k;
+    if (c->size+len <= CHUNK_SIZE) {
+        chunk__own(ch,k);
+        memmove(c->chars+off+len,c->chars+off,c->size-off);
+        memcpy(c->chars+off,s,len);
+        c->size += len;
+        chunk__tabs(ch,k);
+        chunk__changed(ch,k,1);
+        return;
+    }
+
+    /* the chunk's head, the text and its tail go out in even pieces */
+    int total = c->size+len, pieces = (total+CHUNK_FILL-1)/CHUNK_FILL;
+    ch = chunk__reserve(line,pieces-1);
+    c = ch->c+k;
+    struct chunk old = *c;
+    const char *from[3] = {old.chars, s, old.chars+off};
+    int left[3] = {off, len, old.size-off}, src = 0;
+    memmove(c+pieces,c+1,sizeof(struct chunk)*(ch->n-k-1));
+    ch->n += pieces-1;
+    if (ch->dirty > k+1) ch->dirty += pieces-1;
+    if (ch->known > k+1) ch->known += pieces-1;
+    for (int i = 0; i < pieces; i++, c++) {
+        int size = total/pieces + (i < total%pieces);
+        *c = old;
+        c->chars = slab_alloc(&E.buffer.store,CHUNK_SIZE);
+        c->cap = slab_size(CHUNK_SIZE);
+        c->size = 0;
+        while (c->size < size) {
+            int take = left[src] < size-c->size ? left[src] : size-c->size;
+            memcpy(c->chars+c->size,from[src],take);
+            c->size += take;
+            from[src] += take;
+            if (!(left[src] -= take)) src++;
+        }
+        if (i) c->tabs = 0;
+        chunk__tabs(ch,k+i);
+    }
+    chunk__changed(ch,k,pieces);
+    if (old.cap) slab_free(&E.buffer.store,old.chars,old.cap);
+}
+
+/* Replace the <del> chars of <line> at column <at> by s[0..len); the
+   caller updates line->size */
+void chunk_splice(struct line *line, int at, int del, const char *s, int len) {
+    struct chunks *ch = line->chunks;
+    if (ch->flat) {
+        ch->flat = 0;
+        E.buffer.ragged++;
+    }
+
+    int first = chunk_find(ch,at), k = first, off = at-ch->c[k].col;
+    while (del > 0) {
+        struct chunk *c = ch->c+k;
+        int n = del < c->size-off ? del : c->size-off;
+        if (n == c->size && ch->n > 1) {
+            chunk__drop(ch,k);
+        } else {
+            chunk__own(ch,k);
+            memmove(c->chars+off,c->chars+off+n,c->size-off-n);
+            c->size -= n;
+            chunk__tabs(ch,k);
+            chunk__changed(ch,k++,1);
+        }
+        del -= n;
+        off = 0;
+    }
+    chunk__cols(ch,first);
+    if (!len) return;
+
+    k = chunk_find(ch,at);
+    chunk__insert(line,k,at-ch->c[k].col,s,len);
+    chunk__cols(line->chunks,k);
+}
+
+/* Copy the whole line into <chars>, line->size+1 bytes, and point the
+   chunks in there; the caller sees to the old line->chars */
+void chunk_rebase(struct line *line, char *chars) {
+    struct chunks *ch = line->chunks;
+    for (int k = 0; k < ch->n; k++) {
+        struct chunk *c = ch->c+k;
+        memcpy(chars+c->col,c->chars,c->size);
+        if (c->cap) slab_free(&E.buffer.store,c->chars,c->cap);
+        c->chars = chars+c->col;
+        c->cap = 0;
+    }
+    chars[line->size] = '\0';
+    if (!ch->flat) E.buffer.ragged--;
+    ch->flat = 1;
+}
+
+/* Drop the chunks, leaving line->chars: as they were unless rebased */
+void chunk_free(struct line *line) {
+    struct chunks *ch = line->chunks;
+    if (!ch) return;
+    for (int k = 0; k < ch->n; k++)
+        if (ch->c[k].cap) slab_free(&E.buffer.store,ch->c[k].chars,ch->c[k].cap);
+    if (!ch->flat) E.buffer.ragged--;
+    slab_free(&E.buffer.store,ch,chunk__bytes(ch->cap));
+    line->chunks = NULL;
+}
@@ -0,0 +1,12 @@
+struct line;
+
+#define CHUNK_LINE (1<<20)  /* lines this long are kept in chunks */
+#define CHUNK_SIZE 4096     /* most chars in a chunk */
+#define CHUNK_LOOKAHEAD 64  /* chars past its end highlighting a chunk looks at */
+
+void chunk_line(struct line *line);
+int chunk_find(struct chunks *ch, int col);
+const char *chunk_span(struct line *line, int col, int *n);
+void chunk_splice(struct line *line, int at, int del, const char *s, int len);
+void chunk_rebase(struct line *line, char *chars);
+void chunk_free(struct line *line);
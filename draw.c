@@ -10,23 +10,24 @@
 #include "structures.h"
 #include "highlights.h"
 #include "draw.h"
+#include "process.h"
+#include "chunk.h"
+#include "rope.h"
 
 #define TAB 9
 #define min(a,b) ((a) < (b) ? (a) : (b))
+#define max(a,b) ((a) > (b) ? (a) : (b))
 
 struct str {
     char *data;
-    unsigned int len;
-    unsigned int capacity;
+    size_t len;
+    size_t capacity;
 };
 
-void str_Append(struct str *s, const char *e, int len) {
-    int new_len = s->len+len;
-    if (new_len > INT_MAX) {
-      /* error */
-    }
+void str_Append(struct str *s, const char *e, size_t len) {
+    size_t new_len = s->len+len;
     if (new_len > s->capacity) {
-      unsigned int new_capacity = s->capacity || 1;
+      size_t new_capacity = s->capacity ? s->capacity : 1;
       while (new_len > new_capacity) new_capacity = new_capacity << 1;
 	char *new_data = realloc(s->data, new_capacity);
 	if (new_data == NULL) {
@@ -51,93 +52,319 @@ void editor_message(const char *fmt, ...) {
     E.statusmsg_time = time(NULL);
 }
 
+/* ========================== Screen ========================= */
+
+/* A grid of character cells, the characters and their highlight classes
+   kept apart so that a row or a run of one class is a single memcpy */
+struct grid {
+    char *c;
+    unsigned char *hl;
+};
+
+#define HL_REVERSE HL_NONPRINT  /* mode line: inverse video like nonprintables */
+
+/* The frame being built, and the one the terminal shows (rows x cols) */
+static struct grid frame, screen;
+static int screen_rows, screen_cols;
+
+/* Blank rows <y>..<y>+<n> of grid <g> */
+static void grid_clear(struct grid *g, int y, int n) {
+    memset(g->c+y*screen_cols, ' ', n*screen_cols);
+    memset(g->hl+y*screen_cols, HL_NORMAL, n*screen_cols);
+}
+
+/* Write <len> chars of <s> into frame row <y> from column <x>, as <hl> */
+static void frame_put(int y, int x, const char *s, int len, int hl) {
+    if (len > screen_cols-x) len = screen_cols-x;
+    memcpy(frame.c+y*screen_cols+x, s, len);
+    memset(frame.hl+y*screen_cols+x, hl, len);
+}
+
+/* ========================== Themes ========================= */
+
+/* Colors of the highlight classes: 24-bit, or r < 0 for the terminal's
+   own, see editorSyntaxToColor().  HL_REVERSE is always inverse video. */
+struct theme {
+    const char *name;
+    hlcolor fg[HL_CLASSES];
+};
+
+#define ANSI {-1,-1,-1}
+static const struct theme themes[] = {
+    {"default", {ANSI, ANSI, ANSI, ANSI, ANSI, ANSI, ANSI, ANSI, ANSI}},
+    {"solarized", {
+        [HL_NORMAL] = {131,148,150}, [HL_NONPRINT] = ANSI,
+        [HL_COMMENT] = {88,110,117}, [HL_MLCOMMENT] = {88,110,117},
+        [HL_KEYWORD1] = {181,137,0}, [HL_KEYWORD2] = {133,153,0},
+        [HL_STRING] = {42,161,152}, [HL_NUMBER] = {211,54,130},
+        [HL_MATCH] = {38,139,210}}},
+    {"gruvbox", {
+        [HL_NORMAL] = {235,219,178}, [HL_NONPRINT] = ANSI,
+        [HL_COMMENT] = {146,131,116}, [HL_MLCOMMENT] = {146,131,116},
+        [HL_KEYWORD1] = {251,73,52}, [HL_KEYWORD2] = {250,189,47},
+        [HL_STRING] = {184,187,38}, [HL_NUMBER] = {211,134,155},
+        [HL_MATCH] = {131,165,152}}},
+};
+#undef ANSI
+
+/* The escape that switches the terminal to each class, whole, from any
+   other class [0] or from HL_REVERSE [1], which it also has to undo */
+static struct sgr {
+    char s[32];
+    int len;
+} sgr[2][HL_CLASSES];
+
+/* Use theme <name>, or the default one if NULL: its escapes are worked
+   out here, once, so drawing only copies them */
+void editor_theme(const char *name) {
+    const struct theme *theme = themes;
+    for (unsigned int j = 0; name && j < sizeof(themes)/sizeof(themes[0]); j++)
+        if (!strcmp(themes[j].name, name)) theme = themes+j;
+    if (name && strcmp(theme->name, name)) editor_message("No theme %s", name);
+
+    for (int hl = 0; hl < HL_CLASSES; hl++) {
+        const hlcolor *c = theme->fg+hl;
+        for (int rev = 0; rev < 2; rev++) {
+            struct sgr *e = &sgr[rev][hl];
+            const char *reset = rev ? "0;" : "";
+            if (hl == HL_REVERSE)
+                e->len = snprintf(e->s, sizeof(e->s), "\x1b[7m");
+            else if (c->r >= 0)
+                e->len = snprintf(e->s, sizeof(e->s), "\x1b[%s38;2;%d;%d;%dm", reset, c->r, c->g, c->b);
+            else if (hl == HL_NORMAL)
+                e->len = snprintf(e->s, sizeof(e->s), rev ? "\x1b[0m" : "\x1b[39m");
+            else
+                e->len = snprintf(e->s, sizeof(e->s), "\x1b[%s%dm", reset, editorSyntaxToColor(hl));
+        }
+    }
+    screen_rows = screen_cols = 0;  /* redraw all of it in the new colors */
+}
+
+/* Switch the terminal's attributes from highlight class *cur to <hl> */
+static void screen_sgr(struct str *str, int *cur, int hl) {
+    if (hl == *cur) return;
+    struct sgr *e = &sgr[*cur == HL_REVERSE][hl];
+    str_Append(str, e->s, e->len);
+    *cur = hl;
+}
+
+/* Emit the part of row <y> that differs between frame and screen, a run
+   of one class at a time */
+static void screen_flush_row(struct str *str, int y) {
+    char *c = frame.c+y*screen_cols, *oldc = screen.c+y*screen_cols;
+    unsigned char *hl = frame.hl+y*screen_cols, *oldhl = screen.hl+y*screen_cols;
+    if (!memcmp(c,oldc,screen_cols) && !memcmp(hl,oldhl,screen_cols)) return;
+    int first = 0, last = screen_cols-1, end = screen_cols;
+    while (c[first] == oldc[first] && hl[first] == oldhl[first]) first++;
+    while (c[last] == oldc[last] && hl[last] == oldhl[last]) last--;
+    /* a blank tail is cleared rather than drawn */
+    while (end > first && c[end-1] == ' ' && hl[end-1] == HL_NORMAL) end--;
+
+    char buf[32];
+    int cur = HL_NORMAL;
+    int blen = snprintf(buf,sizeof(buf),"\x1b[%d;%dH",y+1,first+1);
+    str_Append(str, buf, blen);
+    for (int x = first, to = min(last+1, end), run; x < to; x = run) {
+        for (run = x+1; run < to && hl[run] == hl[x]; run++);
+        screen_sgr(str, &cur, hl[x]);
+        str_Append(str, c+x, run-x);
+    }
+    screen_sgr(str, &cur, HL_NORMAL);
+    if (last >= end) str_Append(str, "\x1b[0K", 4);
+}
+
+/* Size the grids to the terminal; after a resize everything is redrawn.
+   Returns 1 if it did resize. */
+static int screen_resize(struct str *str, int rows, int cols) {
+    if (rows == screen_rows && cols == screen_cols) return 0;
+    screen_rows = rows;
+    screen_cols = cols;
+    frame.c = realloc(frame.c, rows*cols);
+    frame.hl = realloc(frame.hl, rows*cols);
+    screen.c = realloc(screen.c, rows*cols);
+    screen.hl = realloc(screen.hl, rows*cols);
+    grid_clear(&screen, 0, rows);
+    /* rows are drawn starting from HL_NORMAL */
+    str_Append(str, sgr[1][HL_NORMAL].s, sgr[1][HL_NORMAL].len);
+    str_Append(str, "\x1b[2J", 4);
+    return 1;
+}
+
+/* The text rows moved up (<d> > 0) or down by |d| lines.  Have the terminal
+   scroll them, inside a scroll region that spares the mode line and echo
+   area, and shift the shadow to match: only the rows scrolled in then
+   differ from the new frame. */
+static void screen_scroll(struct str *str, int d) {
+    int rows = E.terminal.winsize.row, n = d > 0 ? d : -d;
+    if (d == 0 || n >= rows) return;
+
+    char buf[32];
+    int len = snprintf(buf,sizeof(buf),"\x1b[1;%dr\x1b[%d%c\x1b[r",rows,n,d > 0 ? 'S' : 'T');
+    str_Append(str, buf, len);
+
+    int keep = d > 0 ? n : 0, to = d > 0 ? 0 : n;
+    memmove(screen.c+to*screen_cols, screen.c+keep*screen_cols, (rows-n)*screen_cols);
+    memmove(screen.hl+to*screen_cols, screen.hl+keep*screen_cols, (rows-n)*screen_cols);
+    grid_clear(&screen, d > 0 ? rows-n : 0, n);
+}
+
+/* Screen rows <line> takes soft wrapped at <cols> a row, as rope.c counts them */
+static int wrap_rows(struct line *line, int cols) {
+    return line->rsize < cols ? 1 : 1 + line->rsize/cols;
+}
+
+/* Build the frame for the editor state, then write out only what changed
+   since the last one */
 void editor_refresh(void) {
+    /* before drawing, which can take a while far into a big file */
+    if (time(NULL) > E.statusmsg_time + 2) E.statusmsg[0] = '\0';
+
+    int rows = E.terminal.winsize.row, wrap = E.buffer.lines.wrap;
+    int filerow = E.buffer.offset.row+E.buffer.point.row;
+    int filecol = E.buffer.offset.col+E.buffer.point.col;
+    /* the lines on screen; soft wrapped, the first from its row <sub> on */
+    int first = E.buffer.offset.row, last = first+rows-1, sub = 0;
+    if (wrap) {
+        /* resized: only lines wider than the window was or is take other rows */
+        if (wrap != E.terminal.winsize.col)
+            rope_wrap(&E.buffer.lines, wrap = E.terminal.winsize.col);
+        /* scroll only as far as needed to show point */
+        struct line *line = buffer_line(filerow);
+        int y = rope_row(&E.buffer.lines,filerow) + (line ? editorRenderCol(line,filecol)/wrap : 0);
+        if (y < E.buffer.wrap_top) E.buffer.wrap_top = y;
+        else if (y >= E.buffer.wrap_top+rows) E.buffer.wrap_top = y-rows+1;
+        sub = E.buffer.wrap_top;
+        first = rope_row_line(&E.buffer.lines,&sub);
+        for (last = first, y = -sub; (line = buffer_line(last)); last++)
+            if ((y += wrap_rows(line,wrap)) >= rows) break;
+    }
 
     struct str str = {NULL, 0, 0};
     str_Append(&str, "\x1b[?25l", 6); 
-    str_Append(&str, "\x1b[H", 3);
-    for (struct line *line = E.buffer.lines+E.buffer.offset.row;
-	 line < E.buffer.lines+E.buffer.offset.row+E.terminal.winsize.row;
-	 line++) {
-        if (line - E.buffer.lines >= E.buffer.numlines) {
-	    str_Append(&str,"~\x1b[0K\r\n",7);
+    /* buffer position the last frame showed at the top left */
+    static int screen_top, screen_left;
+    int top = wrap ? E.buffer.wrap_top : E.buffer.offset.row, left = wrap ? -1 : E.buffer.offset.col;
+    if (!screen_resize(&str, rows+2, E.terminal.winsize.col) && left == screen_left)
+        screen_scroll(&str, top-screen_top);
+    screen_top = top;
+    screen_left = left;
+    grid_clear(&frame, 0, screen_rows);
+
+    editorUpdateSyntax(first, last);
+    for (int y = 0, at = first; y < rows; y++) {
+        struct line *line = buffer_line(at);
+        if (!line) {
+            frame_put(y, 0, "~", 1, HL_NORMAL);
             continue;
         }
-	
-        int ncols = min(line->rsize - E.buffer.offset.col, E.terminal.winsize.col);
-        int current_color = -1;
-	unsigned char *hl = line->hl+E.buffer.offset.col-1;
-	char *c = line->render+E.buffer.offset.col-1;
-	while ((hl++, c++, ncols--)) {
-                if (*hl == HL_NONPRINT) {
-                    str_Append(&str, "\x1b[7m", 4);
-		    char sym = *c<=26 ? '@'+*c : '?';
-                    str_Append(&str, &sym, 1);
-                    str_Append(&str, "\x1b[0m", 4);
-                } else if (*hl == HL_NORMAL) {
-                    if (current_color != -1) {
-                        str_Append(&str,"\x1b[39m",5);
-                        current_color = -1;
-                    }
-                    str_Append(&str, c, 1);
-                } else {
-                    int color = editorSyntaxToColor(*hl);
-                    if (color != current_color) {
-                        char buf[16];
-                        int clen = snprintf(buf,sizeof(buf),"\x1b[%dm",color);
-                        current_color = color;
-                        str_Append(&str, buf, clen);
-                    }
-                    str_Append(&str, c, 1);
-                }
-	}
-        str_Append(&str, "\x1b[39m", 5);
-        str_Append(&str, "\x1b[0K", 4);
-        str_Append(&str, "\r\n", 2);
+        /* soft wrapped, a line takes as many rows as it needs */
+        left = E.buffer.offset.col;
+        if (!wrap) {
+            at++;
+        } else {
+            left = sub*wrap;
+            if (++sub == wrap_rows(line,wrap)) {
+                sub = 0;
+                at++;
+            }
+        }
+
+        int ncols = min(line->rsize - left, screen_cols);
+        char *c = frame.c+y*screen_cols;
+        unsigned char *hl = frame.hl+y*screen_cols;
+        if (line->chunks) {
+            /* a long line: only the part on screen is rendered */
+            ncols = editorHighlightWindow(line, left, screen_cols, c, hl);
+            for (int x = 0; x < ncols; x++)
+                if (hl[x] == HL_NONPRINT) c[x] = c[x]<=26 ? '@'+c[x] : '?';
+            continue;
+        }
+        if (ncols <= 0) continue;
+        memcpy(c, line->render+left, ncols);
+        for (struct hlrun *run = line->hl; run->len && run->start < left+ncols; run++) {
+            int from = max(run->start-left, 0), to = min(run->start+run->len-left, ncols);
+            if (from >= to) continue;
+            memset(hl+from, run->hl, to-from);
+            if (run->hl == HL_NONPRINT)
+                for (int x = from; x < to; x++) c[x] = c[x]<=26 ? '@'+c[x] : '?';
+        }
     }
 
-    /* mode-line */
-    str_Append(&str, "\x1b[0K", 4);
-    str_Append(&str, "\x1b[7m", 4);
-    char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-        E.buffer.filename, E.buffer.numlines, E.buffer.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus),
-        "%d/%d",E.buffer.offset.row+E.buffer.point.row+1,E.buffer.numlines);
-    if (len > E.terminal.winsize.col) len = E.terminal.winsize.col;
-    str_Append(&str, status, len);
-    while (len < E.terminal.winsize.col) {
-        if (E.terminal.winsize.col - len == rlen) {
-            str_Append(&str,rstatus,rlen);
-            break;
-        } else {
-            str_Append(&str," ",1);
-            len++;
+    /* search matches on screen, or only the current one if there were too many to keep */
+    struct found current = {E.match.row, E.match.col, NULL};
+    struct found *f = E.match.all ? E.match.all+editor_match_index(first, 0) : &current;
+    struct found *end = E.match.all ? E.match.all+E.match.count : &current+1;
+    for (; E.match.len && f < end && f->row <= last; f++) {
+        if (f->row < first) continue;
+        struct line *line = buffer_line(f->row);
+        int from = editorRenderCol(line, f->col), to = editorRenderCol(line, f->col+E.match.len);
+        if (!wrap) {
+            from -= E.buffer.offset.col;
+            to -= E.buffer.offset.col;
+            if (max(from, 0) < min(to, screen_cols))
+                memset(frame.hl+(f->row-first)*screen_cols+max(from, 0), HL_MATCH,
+                       min(to, screen_cols)-max(from, 0));
+            continue;
+        }
+        /* soft wrapped, a match can go on over rows */
+        int y = rope_row(&E.buffer.lines, f->row)-E.buffer.wrap_top;
+        for (int x = from, next; x < to; x = next) {
+            next = min((x/wrap+1)*wrap, to);
+            if (y+x/wrap >= 0 && y+x/wrap < rows)
+                memset(frame.hl+(y+x/wrap)*screen_cols+x%wrap, HL_MATCH, next-x);
         }
     }
-    str_Append(&str,"\x1b[0m\r\n",6);
+
+    /* mode-line */
+    int y = E.terminal.winsize.row;
+    char status[80], rstatus[80];
+    const char *more = buffer_indexed() ? "" : "+"; /* file not split into lines yet */
+    int len = snprintf(status, sizeof(status), "%.20s - %d%s lines %s",
+        E.buffer.filename, E.buffer.numlines, more, E.buffer.dirty ? "(modified)" : "");
+    int rlen = 0;
+    if (E.match.len && E.match.all)
+        rlen = snprintf(rstatus, sizeof(rstatus), "match %d of %d  ", E.match.k+1, E.match.count);
+    else if (E.match.len && E.match.count)
+        rlen = snprintf(rstatus, sizeof(rstatus), "%d matches  ", E.match.count);
+    rlen += snprintf(rstatus+rlen, sizeof(rstatus)-rlen,
+        "%d/%d%s",E.buffer.offset.row+E.buffer.point.row+1,E.buffer.numlines,more);
+    memset(frame.hl+y*screen_cols, HL_REVERSE, screen_cols);
+    frame_put(y, 0, status, len, HL_REVERSE);
+    if (min(len, screen_cols) + rlen <= screen_cols)
+        frame_put(y, screen_cols-rlen, rstatus, rlen, HL_REVERSE);
 
     /* echo area */
-    str_Append(&str,"\x1b[0K",4);
-    if (time(NULL) > E.statusmsg_time + 2) E.statusmsg[0] = '\0';
-    str_Append(&str, E.statusmsg, min(strlen(E.statusmsg), E.terminal.winsize.col));
+    frame_put(y+1, 0, E.statusmsg, strlen(E.statusmsg), HL_NORMAL);
+
+    for (y = 0; y < screen_rows; y++) screen_flush_row(&str, y);
+    struct grid shown = screen;
+    screen = frame;
+    frame = shown;
 
     /* flush point NB: col ≢ E.buffer.point.col (TABs) */
-    int point_col = 1;
-    int filerow = E.buffer.offset.row + E.buffer.point.row;
-    struct line *row = (filerow >= E.buffer.numlines) ? NULL : &E.buffer.lines[filerow];
-    if (row) {
+    int point_row = E.buffer.point.row+1, point_col = 1;
+    struct line *row = buffer_line(filerow);
+    if (wrap) {
+        int rcol = row ? editorRenderCol(row, filecol) : 0;
+        point_row = rope_row(&E.buffer.lines, filerow) + rcol/wrap - E.buffer.wrap_top + 1;
+        point_col = rcol%wrap + 1;
+    } else if (row) {
+        const char *s = NULL;
+        int n = 0;
         for (int j = E.buffer.offset.col; j < (E.buffer.point.col+E.buffer.offset.col); j++) {
-            if (j < row->size && row->chars[j] == TAB) point_col += 7-((point_col)%8);
+            if (j < row->size) {
+                if (n == 0) s = chunk_span(row, j, &n); /* long lines are in pieces */
+                n--;
+                if (*s++ == TAB) point_col += 7-((point_col)%8);
+            }
             point_col++;
         }
     }
     char buf[32];
-    snprintf(buf,sizeof(buf),"\x1b[%d;%dH",E.buffer.point.row+1,point_col);
+    snprintf(buf,sizeof(buf),"\x1b[%d;%dH",point_row,point_col);
     str_Append(&str, buf, strlen(buf));
     str_Append(&str, "\x1b[?25h", 6);
 
     write(STDOUT_FILENO, str.data, str.len);
     str_Free(&str);
 }
-
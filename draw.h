@@ -1,3 +1,4 @@
 struct line;
 void editor_refresh(void);
+void editor_theme(const char *name);
 void editor_message(const char *fmt, ...);
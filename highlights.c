@@ -3,27 +3,28 @@
 #include <string.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "structures.h"
 #include "highlights.h"
+#include "process.h"
+#include "slab.h"
+#include "rope.h"
+#include "chunk.h"
+
+#define TAB 9
 
 /* =========================== Syntax highlights =========================
  *
- * add new syntax: define array of file-subnames/file-extensions (beginning with .), array of keywords
+ * add new syntax: a stanza in HLDB, all data.  It has the file-subnames or
+ * file-extensions (beginning with .) it is for, its keywords, its comment
+ * delimiters, the chars its words end at, its strings are quoted with and
+ * its numbers go on with, and flags to highlight strings and numbers.
  *
  * keywords with trailing '|' highlighted in different color
- *
- * add a stanza in HLDB with two two arrays of strings, and a set of flags in order to enable highlighting of
- * comments and numbers.
- *
- * comment chars must come in pairs
  */
 
-char *Python_HL_extensions[] = {".py",NULL};
-char *Python_HL_keywords[] = {
-  "def", "return", "lambda", 
-};
-
 char *C_HL_extensions[] = {".c",".h",".cpp",".hpp",".cc",NULL};
 char *C_HL_keywords[] = {
 	/* C Keywords */
@@ -45,160 +46,796 @@ char *C_HL_keywords[] = {
         "void|","short|","auto|","const|","bool|",NULL
 };
 
+char *Python_HL_extensions[] = {".py",NULL};
+char *Python_HL_keywords[] = {
+  "and","as","assert","async","await","break","class","continue","def",
+  "del","elif","else","except","finally","for","from","global","if",
+  "import","in","is","lambda","nonlocal","not","or","pass","raise",
+  "return","try","while","with","yield","None","True","False",
+
+  "int|","float|","str|","bytes|","bool|","list|","dict|","set|",
+  "tuple|","object|","self|",NULL
+};
+
+char *JS_HL_extensions[] = {".js",".mjs",".ts",NULL};
+char *JS_HL_keywords[] = {
+  "async","await","break","case","catch","class","const","continue",
+  "debugger","default","delete","do","else","export","extends","finally",
+  "for","function","if","import","in","instanceof","let","new","of",
+  "return","super","switch","this","throw","try","typeof","var","void",
+  "while","with","yield","null","undefined","true","false",
+
+  "Array|","Object|","String|","Number|","Boolean|","Promise|","Map|",
+  "Set|",NULL
+};
+
+char *Go_HL_extensions[] = {".go",NULL};
+char *Go_HL_keywords[] = {
+  "break","case","chan","const","continue","default","defer","else",
+  "fallthrough","for","func","go","goto","if","import","interface","map",
+  "package","range","return","select","struct","switch","type","var",
+  "nil","true","false","iota",
+
+  "bool|","byte|","error|","int|","int8|","int16|","int32|","int64|",
+  "rune|","string|","uint|","uint8|","uint16|","uint32|","uint64|",
+  "uintptr|","float32|","float64|","any|",NULL
+};
+
 /* array of syntax highlights by extensions, keywords, comments, flags */
 struct editorSyntax HLDB[] = {
   {
-        C_HL_extensions,
-        C_HL_keywords,
-        "//","/*","*/",
-	HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS
+        .filematch = C_HL_extensions,
+        .keywords = C_HL_keywords,
+        .singleline_comment_start = "//",
+        .multiline_comment_start = "/*",
+        .multiline_comment_end = "*/",
+        .separators = ",.()+-/*=~%[];{}<>!&|^?:",
+        .quotes = "\"'",
+        .number_chars = ".xXabcdefABCDEFuUlL",
+        .flags = HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS
+  },
+  {
+        .filematch = Python_HL_extensions,
+        .keywords = Python_HL_keywords,
+        .singleline_comment_start = "#",
+        .multiline_comment_start = "\"\"\"",   /* docstrings */
+        .multiline_comment_end = "\"\"\"",
+        .separators = ",.()+-/*=~%[];{}<>!&|^:@",
+        .quotes = "\"'",
+        .number_chars = "._xXoObBjJabcdefABCDEF",
+        .flags = HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS
   },
   {
-        Python_HL_extensions,
-        Python_HL_keywords,
-        "##",
-        HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS
+        .filematch = JS_HL_extensions,
+        .keywords = JS_HL_keywords,
+        .singleline_comment_start = "//",
+        .multiline_comment_start = "/*",
+        .multiline_comment_end = "*/",
+        .separators = ",.()+-/*=~%[];{}<>!&|^?:",
+        .quotes = "\"'`",
+        .number_chars = "._xXoObBnabcdefABCDEF",
+        .flags = HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS
+  },
+  {
+        .filematch = Go_HL_extensions,
+        .keywords = Go_HL_keywords,
+        .singleline_comment_start = "//",
+        .multiline_comment_start = "/*",
+        .multiline_comment_end = "*/",
+        .separators = ",.()+-/*=~%[];{}<>!&|^:",
+        .quotes = "\"'`",
+        .number_chars = "._xXoObBiabcdefABCDEFpP",
+        .flags = HL_HIGHLIGHT_STRINGS | HL_HIGHLIGHT_NUMBERS
   }
 };
 
 #define HLDB_ENTRIES (sizeof(HLDB)/sizeof(HLDB[0]))
 
-int is_separator(int c) {
-    return c == '\0' || isspace(c) || strchr(",.()+-/*=~%[];",c) != NULL;
+/* ============================== Lexer ==============================
+ *
+ * A language is compiled into a lexer: the class of each char, chars of a
+ * class being alike in every way the language cares about, and the move
+ * to make on a char of each class in each state, copied out to each char
+ * of it so a lookup is one load.  Most moves stay in the
+ * state, as the chars of a word, a blank run, a comment or a string do:
+ * runs of those are skipped at once.  Others step to another state, maybe
+ * after trying the comment delimiters the char could start, or look the
+ * word starting there up in the keywords.
+ */
+
+enum {
+    LX_SEP,         /* after a separator; a zeroed hlstate starts a line */
+    LX_WORD,        /* in a word, or after one */
+    LX_NUMBER,
+    LX_STRING,      /* until hlstate.string */
+    LX_COMMENT,     /* multi-line */
+    LX_LINE,        /* single-line comment: the rest of the line is too */
+    LX_STATES
+};
+
+/* State a line is entered in when the one above ends <in_comment> */
+#define LX_ENTRY(in_comment) ((in_comment) ? LX_COMMENT : LX_SEP)
+
+/* What a char is to a language */
+#define LX_BLANK (1<<0)     /* or a separator */
+#define LX_DIGIT (1<<1)
+#define LX_NUMCHAR (1<<2)
+#define LX_QUOTE (1<<3)
+#define LX_ESCAPE (1<<4)
+#define LX_NONPRINT (1<<5)
+#define LX_SCS (1<<6)       /* first char of a comment delimiter */
+#define LX_MCS (1<<7)
+#define LX_MCE (1<<8)
+#define LX_ROLES (1<<9)
+
+/* Moves */
+#define LX_STAY 0       /* stay, the char of the state's own class */
+#define LX_STEP 1       /* class it hl and go to state */
+#define LX_KEYWORD 2    /* a word starts: look it up */
+#define LX_OPEN 3       /* open a string */
+#define LX_CLOSE 4      /* close the string, if it is its quote */
+#define LX_ESC 5        /* escape the next char of a string */
+
+/* Delimiters to try before making a move */
+#define LX_TRY_LINE (1<<0)
+#define LX_TRY_OPEN (1<<1)
+#define LX_TRY_CLOSE (1<<2)
+
+struct lexmove {
+    unsigned char op;
+    unsigned char state;
+    unsigned char hl;
+    unsigned char delim;
+};
+
+struct keyword {
+    char *word;
+    int len;            /* excl. trailing '|' */
+    int hl;             /* HL_KEYWORD1 or HL_KEYWORD2 */
+};
+
+struct lexer {
+    unsigned char cls[256];     /* class of each char */
+    unsigned short role[256];   /* LX_BLANK... of each class */
+    int nclasses;
+    struct lexmove move[LX_STATES][256];    /* on each char, that of its class */
+
+    const char *delim[3];       /* single-line start, multi-line start and end */
+    int delimlen[3];
+
+    /* Keywords are looked up in an open-addressed hash table keyed on the
+       word's length and its first and last chars */
+    struct keyword *kwtable;
+    unsigned int kwmask;        /* kwtable size - 1 */
+    int kwmax;                  /* longest keyword */
+    unsigned int kwlens[256];   /* bit n: a keyword of length n, or 31 and up, starts with the char */
+};
+
+static unsigned int kw_hash(const char *s, int len) {
+    return (unsigned char)s[0]*31u + (unsigned char)s[len-1]*7u + len;
 }
 
-int editorRowHasOpenComment(struct line *row) {
-    if (row->hl && row->rsize && row->hl[row->rsize-1] == HL_MLCOMMENT &&
-        (row->rsize < 2 || (row->render[row->rsize-2] != '*' ||
-                            row->render[row->rsize-1] != '/'))) return 1;
+static void editorCompileKeywords(struct lexer *lx, char **keywords) {
+    unsigned int n = 0, size = 16;
+    while (keywords[n]) n++;
+    while (size < 2*n) size <<= 1;
+    lx->kwtable = calloc(size,sizeof(struct keyword));
+    lx->kwmask = size-1;
+
+    for (unsigned int j = 0; j < n; j++) {
+        char *word = keywords[j];
+        int len = strlen(word);
+        int kw2 = word[len-1] == '|';
+        if (kw2) len--;
+        if (len > lx->kwmax) lx->kwmax = len;
+        lx->kwlens[(unsigned char)word[0]] |= 1u << (len < 31 ? len : 31);
+
+        unsigned int h = kw_hash(word,len) & lx->kwmask;
+        while (lx->kwtable[h].len) {
+            struct keyword *k = lx->kwtable+h;
+            if (k->len == len && !memcmp(k->word,word,len)) break; /* first one wins */
+            h = (h+1) & lx->kwmask;
+        }
+        if (lx->kwtable[h].len) continue;
+        lx->kwtable[h].word = word;
+        lx->kwtable[h].len = len;
+        lx->kwtable[h].hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+    }
+}
+
+/* HL_KEYWORD1/2 if the <len> chars at <s> are a keyword, else 0 */
+static int editorKeyword(struct lexer *lx, const char *s, int len) {
+    if (!(lx->kwlens[(unsigned char)s[0]] >> (len < 31 ? len : 31) & 1)) return 0;
+    unsigned int h = kw_hash(s,len) & lx->kwmask;
+    for (struct keyword *k; (k = lx->kwtable+h)->len; h = (h+1) & lx->kwmask)
+        if (k->len == len && !memcmp(k->word,s,len)) return k->hl;
     return 0;
 }
 
-/* update line->hl in light of line->render */
-void editorUpdateSyntax(struct line *row) {
-    row->hl = realloc(row->hl,row->rsize);
-    memset(row->hl,HL_NORMAL,row->rsize);
+/* The move on a char of <role> in <state> */
+static struct lexmove editorMove(int state, int role) {
+    /* the class of the chars that stay in each state */
+    static const unsigned char fill[LX_STATES] = {
+        HL_NORMAL, HL_NORMAL, HL_NUMBER, HL_STRING, HL_MLCOMMENT, HL_COMMENT};
+
+    struct lexmove mv = {LX_STEP, state, HL_NORMAL, 0};
+    switch (state) {
+    case LX_STRING:
+        mv.hl = HL_STRING;
+        if (role & LX_QUOTE) mv.op = LX_CLOSE;
+        else if (role & LX_ESCAPE) mv.op = LX_ESC;
+        break;
+    case LX_COMMENT:
+        mv.hl = HL_MLCOMMENT;
+        if (role & LX_MCE) mv.delim = LX_TRY_CLOSE;
+        break;
+    case LX_LINE:
+        mv.hl = HL_COMMENT;
+        break;
+    default:
+        if (role & LX_SCS) mv.delim |= LX_TRY_LINE;
+        if (role & LX_MCS) mv.delim |= LX_TRY_OPEN;
+        if (role & LX_QUOTE) {
+            mv.op = LX_OPEN;
+            mv.hl = HL_STRING;
+        } else if (role & LX_NONPRINT) {
+            mv.state = LX_WORD;
+            mv.hl = HL_NONPRINT;
+        } else if (state == LX_NUMBER && role & (LX_DIGIT|LX_NUMCHAR)) {
+            mv.hl = HL_NUMBER;
+        } else if (role & LX_BLANK) {
+            mv.state = LX_SEP;
+        } else if (state == LX_SEP && role & LX_DIGIT) {
+            mv.state = LX_NUMBER;
+            mv.hl = HL_NUMBER;
+        } else if (state == LX_SEP) {
+            mv.op = LX_KEYWORD;
+        } else {
+            mv.state = LX_WORD;
+        }
+    }
+    if (mv.op == LX_STEP && mv.state == state && mv.hl == fill[state] && !mv.delim)
+        mv.op = LX_STAY;
+    return mv;
+}
+
+static int has(const char *set, int c) {
+    return set && c && strchr(set,c) != NULL;
+}
+
+static struct lexer *editorCompileSyntax(struct editorSyntax *syntax) {
+    struct lexer *lx = calloc(1,sizeof(*lx));
+    char *delim[3] = {syntax->singleline_comment_start,
+                      syntax->multiline_comment_start,
+                      syntax->multiline_comment_end};
+    for (int d = 0; d < 3; d++) {
+        lx->delim[d] = delim[d];
+        lx->delimlen[d] = delim[d] ? strlen(delim[d]) : 0;
+    }
+    int strings = syntax->flags & HL_HIGHLIGHT_STRINGS;
+    int numbers = syntax->flags & HL_HIGHLIGHT_NUMBERS;
+
+    /* chars of the same role are of the same class */
+    short class_of[LX_ROLES];
+    memset(class_of,-1,sizeof(class_of));
+    for (int c = 0; c < 256; c++) {
+        int role = 0;
+        if (c == ' ' || c == TAB || has(syntax->separators,c)) role |= LX_BLANK;
+        if (!isprint(c) && c != TAB) role |= LX_NONPRINT;
+        if (numbers && isdigit(c)) role |= LX_DIGIT;
+        if (numbers && has(syntax->number_chars,c)) role |= LX_NUMCHAR;
+        if (strings && has(syntax->quotes,c)) role |= LX_QUOTE;
+        if (strings && c == '\\') role |= LX_ESCAPE;
+        if (lx->delimlen[0] && c == (unsigned char)delim[0][0]) role |= LX_SCS;
+        if (lx->delimlen[1] && c == (unsigned char)delim[1][0]) role |= LX_MCS;
+        if (lx->delimlen[2] && c == (unsigned char)delim[2][0]) role |= LX_MCE;
+        if (class_of[role] < 0) {
+            class_of[role] = lx->nclasses;
+            lx->role[lx->nclasses++] = role;
+        }
+        lx->cls[c] = class_of[role];
+    }
+
+    for (int state = 0; state < LX_STATES; state++) {
+        struct lexmove mv[256];
+        for (int k = 0; k < lx->nclasses; k++) mv[k] = editorMove(state,lx->role[k]);
+        for (int c = 0; c < 256; c++) lx->move[state][c] = mv[lx->cls[c]];
+    }
+    editorCompileKeywords(lx,syntax->keywords);
+    return lx;
+}
+
+/* Length of delimiter <d> of <lx> if the <len> chars at <s> start with it,
+   else 0 */
+static int editorDelimiter(struct lexer *lx, int d, const char *s, int len) {
+    int n = lx->delimlen[d];
+    return n <= len && !memcmp(s,lx->delim[d],n) ? n : 0;
+}
+
+/* Highlight the chars of <s> up to <stop> into <hl>, entering them in state
+   <st>, and leave *st as it is after them.  Chars up to <len> are looked
+   at, and classed too when a word or comment delimiter runs on past
+   <stop>: st->skip says how many of the next ones are done then.  Works
+   on line->render or, as TABs count as spaces, on line->chars, whole or a
+   chunk at a time. */
+static void editorHighlightFrom(const char *s, int stop, int len, unsigned char *hl,
+                                struct hlstate *st) {
+    memset(hl,HL_NORMAL,len);
     if (E.buffer.syntax == NULL) return;
+    if (st->state == LX_LINE) {
+        memset(hl,HL_COMMENT,len);
+        return;
+    }
 
-    int i, prev_sep, in_string, in_comment;
-    char *p;
-    char **keywords = E.buffer.syntax->keywords;
-    char *scs = E.buffer.syntax->singleline_comment_start;
-    char *mcs = E.buffer.syntax->multiline_comment_start;
-    char *mce = E.buffer.syntax->multiline_comment_end;
-
-    /* Point to first non-space char */
-    p = row->render;
-    i = 0; /* Current char offset */
-    while(*p && isspace(*p)) {
-        p++;
-        i++;
-    }
-    prev_sep = 1; /* Tell parser if 'i' points to start of word */
-    in_string = 0; /* inside "" or '' */
-    in_comment = (row->idx > 0 && editorRowHasOpenComment(&E.buffer.lines[row->idx-1]));
-    /* inside multi-line comment? */
-    while(*p) {
-        /* single-line comments */
-        if (prev_sep && *p == scs[0] && *(p+1) == scs[1]) {
-            memset(row->hl+i,HL_COMMENT,row->size-i);
-            return;
-        }
-
-        /* multi-line comments */
-        if (in_comment) {
-            row->hl[i] = HL_MLCOMMENT;
-            if (*p == mce[0] && *(p+1) == mce[1]) {
-                row->hl[i+1] = HL_MLCOMMENT;
-                p += 2; i += 2;
-                in_comment = 0;
-                prev_sep = 1;
-                continue;
-            } else {
-                prev_sep = 0;
-                p++; i++;
-                continue;
-            }
-        } else if (*p == mcs[0] && *(p+1) == mcs[1]) {
-            row->hl[i] = HL_MLCOMMENT;
-            row->hl[i+1] = HL_MLCOMMENT;
-            p += 2; i += 2;
-            in_comment = 1;
-            prev_sep = 0;
+    struct lexer *lx = E.buffer.syntax->lexer;
+    const struct lexmove *moves = lx->move[st->state];
+    int i = st->skip, state = st->state, n;
+    memset(hl,st->skiphl,i < len ? i : len);
+
+    while (i < stop) {
+        const struct lexmove *mv = moves+(unsigned char)s[i];
+        if (mv->op == LX_STAY) {
+            /* the bulk of the chars: runs of them in one go */
+            int j = i+1;
+            while (j < stop && moves[(unsigned char)s[j]].op == LX_STAY) j++;
+            if (mv->hl != HL_NORMAL) memset(hl+i,mv->hl,j-i);
+            i = j;
             continue;
         }
-
-        /* Handle "" and '' */
-        if (in_string) {
-            row->hl[i] = HL_STRING;
-            if (*p == '\\') {
-                row->hl[i+1] = HL_STRING;
-                p += 2; i += 2;
-                prev_sep = 0;
-                continue;
+        if (mv->delim) {
+            if (mv->delim & LX_TRY_LINE && editorDelimiter(lx,0,s+i,len-i)) {
+                memset(hl+i,HL_COMMENT,len-i);
+                st->state = LX_LINE;
+                st->skip = 0;
+                return;
             }
-            if (*p == in_string) in_string = 0;
-            p++; i++;
-            continue;
-        } else {
-            if (*p == '"' || *p == '\'') {
-                in_string = *p;
-                row->hl[i] = HL_STRING;
-                p++; i++;
-                prev_sep = 0;
+            if ((mv->delim & LX_TRY_OPEN && (n = editorDelimiter(lx,1,s+i,len-i))) ||
+                (mv->delim & LX_TRY_CLOSE && (n = editorDelimiter(lx,2,s+i,len-i)))) {
+                memset(hl+i,HL_MLCOMMENT,n);
+                i += n;
+                state = state == LX_COMMENT ? LX_SEP : LX_COMMENT;
+                moves = lx->move[state];
                 continue;
             }
         }
 
-        if (!isprint(*p)) {
-            row->hl[i] = HL_NONPRINT;
-            p++; i++;
-            prev_sep = 0;
-            continue;
+        switch (mv->op) {
+        case LX_KEYWORD: {
+            /* the word is the chars that stay in a word: only one no longer
+               than the keywords is looked up, past <stop> if need be */
+            const struct lexmove *word = lx->move[LX_WORD];
+            n = 1;
+            while (i+n < stop && word[(unsigned char)s[i+n]].op == LX_STAY) n++;
+            while (i+n < len && n <= lx->kwmax && word[(unsigned char)s[i+n]].op == LX_STAY) n++;
+            int kw = n <= lx->kwmax ? editorKeyword(lx,s+i,n) : 0;
+            if (kw) memset(hl+i,kw,n);
+            i += n;
+            state = LX_WORD;
+            break;
+        }
+        case LX_OPEN:
+            st->string = s[i];
+            hl[i++] = HL_STRING;
+            state = LX_STRING;
+            break;
+        case LX_CLOSE:
+            hl[i] = HL_STRING;
+            if (s[i++] == st->string) {
+                st->string = 0;
+                state = LX_WORD;
+            }
+            break;
+        case LX_ESC:
+            hl[i++] = HL_STRING;
+            if (i < len) hl[i++] = HL_STRING;
+            break;
+        default:
+            hl[i++] = mv->hl;
+            state = mv->state;
+        }
+        moves = lx->move[state];
+    }
+    st->state = state;
+    st->skip = i > stop ? i-stop : 0;
+    if (i > stop) st->skiphl = hl[stop];
+}
+
+/* Highlight the <len> chars of <s> into <hl>, starting inside a multi-line
+   comment if <in_comment>.  Returns whether the line ends inside one. */
+static int editorHighlight(const char *s, int len, unsigned char *hl, int in_comment) {
+    struct hlstate st = {.state = LX_ENTRY(in_comment)};
+    editorHighlightFrom(s,len,len,hl,&st);
+    return st.state == LX_COMMENT;
+}
+
+/* Room for the per-char classes of a line of <len> */
+static unsigned char *editorScratch(int len) {
+    static unsigned char *scratch = NULL;
+    static int scratchsize = 0;
+    if (len > scratchsize || !scratch) {
+        scratchsize = len ? len : 1;
+        scratch = realloc(scratch,scratchsize);
+    }
+    return scratch;
+}
+
+/* The runs of lines that are all HL_NORMAL, shared */
+static struct hlrun hl_plain[1];
+
+/* Free the highlight runs of <row>, if any */
+void editorFreeHighlight(struct line *row) {
+    if (row->hl && row->hl != hl_plain) {
+        int n = 1;
+        while (row->hl[n-1].len) n++;
+        slab_free(&E.buffer.store,row->hl,sizeof(struct hlrun)*n);
+    }
+    row->hl = NULL;
+}
+
+static void editorChunksUpTo(struct chunks *ch, int upto);
+
+/* Highlight line <at> on screen, entering it in state <state>.  The classes
+   are worked out a char at a time, then kept as runs of the same class
+   other than HL_NORMAL: most of a line is plain, so a few runs do. */
+static void editorHighlightLine(int at, int state) {
+    struct line *row = buffer_line(at);
+    if (!row->render && !row->chunks) {
+        buffer_render_line(at);
+        row = buffer_line(at);
+    }
+    if (row->chunks) {
+        /* only the state it ends in: the rest is done as it is drawn */
+        struct chunks *ch = row->chunks;
+        if (ch->c[0].hl.state != LX_ENTRY(state)) {
+            ch->c[0].hl = (struct hlstate){.state = LX_ENTRY(state)};
+            if (ch->dirty <= ch->valid) ch->dirty = 1;
+            ch->valid = 1;
+        }
+        editorChunksUpTo(ch,ch->n);
+        row->hl_oc = ch->end.state == LX_COMMENT;
+        row->hl_ic = state;
+        row->hl_stale = 0;
+        editorFreeHighlight(row);
+        row->hl = hl_plain;
+        return;
+    }
+    unsigned char *hl = editorScratch(row->rsize);
+    row->hl_oc = editorHighlight(row->render,row->rsize,hl,state);
+    row->hl_ic = state;
+    row->hl_stale = 0;
+    editorFreeHighlight(row);
+
+    int n = 0, i, j;
+    for (i = 0; i < row->rsize; i = j) {
+        for (j = i+1; j < row->rsize && hl[j] == hl[i] && j-i < HLRUN_MAX; j++);
+        n += hl[i] != HL_NORMAL;
+    }
+    if (n == 0) {
+        row->hl = hl_plain;
+        return;
+    }
+    struct hlrun *run = row->hl = slab_alloc(&E.buffer.store,sizeof(struct hlrun)*(n+1));
+    for (i = 0; i < row->rsize; i = j) {
+        for (j = i+1; j < row->rsize && hl[j] == hl[i] && j-i < HLRUN_MAX; j++);
+        if (hl[i] == HL_NORMAL) continue;
+        run->start = i;
+        run->len = j-i;
+        run->hl = hl[i];
+        run++;
+    }
+    run->start = row->rsize;
+    run->len = 0;
+    run->hl = HL_NORMAL;
+}
+
+/* ============================ Long lines ============================
+ *
+ * A chunked line (see chunk.c) is highlighted a chunk at a time.  Each
+ * chunk has an entry: the state highlighting enters it in and its column
+ * in the render, so a screenful from anywhere in the line is drawn from a
+ * chunk or two.  An edit makes the entries after it wrong.  They are
+ * worked out again when needed, and once one comes out as it was, the
+ * rest stand but for a shift of their render columns.  A chunk is
+ * highlighted with CHUNK_LOOKAHEAD chars of the next ones after it, for
+ * the words and comment delimiters that run on into them.
+ */
+
+#define CHUNK_TEXT (CHUNK_SIZE+CHUNK_LOOKAHEAD)
+
+/* Chunk <k> of <ch> and the chars it looks ahead at, into <text>, of
+   CHUNK_TEXT; returns how many in all */
+static int editorChunkText(struct chunks *ch, int k, char *text) {
+    int size = ch->c[k].size, len = size;
+    memcpy(text,ch->c[k].chars,size);
+    for (int j = k+1; j < ch->n && len < size+CHUNK_LOOKAHEAD; j++) {
+        int n = size+CHUNK_LOOKAHEAD-len;
+        if (n > ch->c[j].size) n = ch->c[j].size;
+        memcpy(text+len,ch->c[j].chars,n);
+        len += n;
+    }
+    return len;
+}
+
+/* Highlight chunk <k> into <hl>, entering it in *st at render column
+   *rcol, and leave both as they are after it */
+static void editorChunkScan(struct chunks *ch, int k, struct hlstate *st, int *rcol,
+                            char *text, unsigned char *hl) {
+    struct chunk *c = ch->c+k;
+    editorHighlightFrom(text,c->size,editorChunkText(ch,k,text),hl,st);
+    if (!c->tabs) {
+        *rcol += c->size;
+        return;
+    }
+    for (int j = 0; j < c->size; j++) {
+        (*rcol)++;
+        if (c->chars[j] == TAB)
+            while((*rcol+1) % 8 != 0) (*rcol)++;
+    }
+}
+
+/* Make the entries of <ch> right up to entry <upto>, entry ch->n being
+   the state at the end of the line */
+static void editorChunksUpTo(struct chunks *ch, int upto) {
+    static char text[CHUNK_TEXT];
+    static unsigned char hl[CHUNK_TEXT];
+    while (ch->valid <= upto) {
+        int k = ch->valid-1, rcol = ch->c[k].rcol;
+        struct hlstate st = ch->c[k].hl;
+        editorChunkScan(ch,k,&st,&rcol,text,hl);
+        ch->valid++;
+        if (k+1 == ch->n) {
+            ch->end = st;
+            break;
         }
 
-        if ((isdigit(*p) && (prev_sep || row->hl[i-1] == HL_NUMBER)) ||
-            (*p == '.' && i >0 && row->hl[i-1] == HL_NUMBER)) {
-            row->hl[i] = HL_NUMBER;
-            p++; i++;
-            prev_sep = 0;
+        struct chunk *next = ch->c+k+1;
+        int shift = rcol-next->rcol;
+        if (k+1 >= ch->dirty && k+1 < ch->known && !memcmp(&st,&next->hl,sizeof(st)) &&
+            (!ch->tabs || shift % 8 == 0)) {
+            /* as before from here on */
+            for (int j = k+1; j < ch->known && j < ch->n; j++) ch->c[j].rcol += shift;
+            ch->valid = ch->known;
             continue;
         }
+        next->hl = st;
+        next->rcol = rcol;
+    }
+    if (ch->known < ch->valid) ch->known = ch->valid;
+}
 
-        /* keywords and lib calls */
-        if (prev_sep) {
-            int j;
-            for (j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen-1] == '|';
-                if (kw2) klen--;
-
-                if (!memcmp(p,keywords[j],klen) &&
-                    is_separator(*(p+klen)))
-                {
-                    /* Keyword */
-                    memset(row->hl+i,kw2 ? HL_KEYWORD2 : HL_KEYWORD1,klen);
-                    p += klen;
-                    i += klen;
-                    break;
-                }
-            }
-            if (keywords[j] != NULL) {
-                prev_sep = 0;
-                continue; /* We had a keyword match */
+/* State chunked line <row> ends in when entered in <state>.  Leaves the
+   entries alone, as it runs on worker threads, see below. */
+static int editorChunksState(struct line *row, int state) {
+    struct chunks *ch = row->chunks;
+    if (ch->valid > ch->n && ch->c[0].hl.state == LX_ENTRY(state))
+        return ch->end.state == LX_COMMENT;
+
+    char *text = malloc(CHUNK_TEXT);
+    unsigned char *hl = malloc(CHUNK_TEXT);
+    struct hlstate st = {.state = LX_ENTRY(state)};
+    int rcol = 0;
+    for (int k = 0; k < ch->n; k++) editorChunkScan(ch,k,&st,&rcol,text,hl);
+    free(text);
+    free(hl);
+    return st.state == LX_COMMENT;
+}
+
+/* Render column of column <col> of <row>, chunked or not, see
+   buffer_render_line() */
+int editorRenderCol(struct line *row, int col) {
+    struct chunks *ch = row->chunks;
+    if (col > row->size) col = row->size;
+    if (!ch) {
+        int rcol = 0;
+        for (int j = 0; j < col; j++) {
+            rcol++;
+            if (row->chars[j] == TAB)
+                while((rcol+1) % 8 != 0) rcol++;
+        }
+        return rcol;
+    }
+    if (!ch->tabs) return col;
+
+    int k = chunk_find(ch,col), rcol;
+    editorChunksUpTo(ch,k);
+    rcol = ch->c[k].rcol;
+    for (int j = 0; j < col-ch->c[k].col; j++) {
+        rcol++;
+        if (ch->c[k].chars[j] == TAB)
+            while((rcol+1) % 8 != 0) rcol++;
+    }
+    return rcol;
+}
+
+/* Column of <row> drawn at render column <rcol>, its size past the end */
+int editorColAt(struct line *row, int rcol) {
+    struct chunks *ch = row->chunks;
+    const char *s = row->chars;
+    int col = 0, size = row->size, idx = 0;
+    if (ch && !ch->tabs) return rcol < size ? rcol : size;
+    if (ch) {
+        editorChunksUpTo(ch,ch->n);
+        int lo = 0, hi = ch->n-1;
+        while (lo < hi) {
+            int mid = hi - (hi-lo)/2;
+            if (ch->c[mid].rcol <= rcol) lo = mid;
+            else hi = mid-1;
+        }
+        s = ch->c[lo].chars;
+        col = ch->c[lo].col;
+        size = col+ch->c[lo].size;
+        idx = ch->c[lo].rcol;
+    }
+    for (; col < size; col++, s++) {
+        idx++;
+        if (*s == TAB)
+            while((idx+1) % 8 != 0) idx++;
+        if (idx > rcol) return col;
+    }
+    return col;
+}
+
+/* Render columns <left>..<left>+<cols> of chunked line <row> into <c> and
+   their classes into <hl>.  Returns how many the line has of them. */
+int editorHighlightWindow(struct line *row, int left, int cols, char *c, unsigned char *hl) {
+    static char text[CHUNK_TEXT];
+    static unsigned char chl[CHUNK_TEXT];
+    struct chunks *ch = row->chunks;
+    editorChunksUpTo(ch,ch->n);
+
+    /* the last chunk starting at or before <left> */
+    int lo = 0, hi = ch->n-1, x = 0;
+    while (lo < hi) {
+        int mid = hi - (hi-lo)/2;
+        if (ch->c[mid].rcol <= left) lo = mid;
+        else hi = mid-1;
+    }
+    for (int k = lo; k < ch->n && x < cols; k++) {
+        struct chunk *chunk = ch->c+k;
+        struct hlstate st = chunk->hl;
+        int rcol = chunk->rcol;
+        editorHighlightFrom(text,chunk->size,editorChunkText(ch,k,text),chl,&st);
+        for (int j = 0; j < chunk->size && x < cols; j++) {
+            int next = rcol+1;
+            if (text[j] == TAB)
+                while((next+1) % 8 != 0) next++;
+            for (; rcol < next && x < cols; rcol++) {
+                if (rcol < left) continue;
+                c[x] = text[j] == TAB ? ' ' : text[j];
+                hl[x++] = chl[j];
             }
+            rcol = next;
         }
+    }
+    return x;
+}
+
+/* ======================= Scanning off screen =======================
+ *
+ * Lines above the screen only have the state they end in worked out.  A
+ * long way of them, as after jumping far into a big file, is cut into
+ * shares scanned on as many threads.  All but the first share start in an
+ * unknown state, so are scanned assuming it is "not in a comment".  Then,
+ * in order, a share whose real entry state turns out different is scanned
+ * again only until its states meet the ones assumed: usually a comment
+ * closes within a few lines and the rest of the share stands.
+ */
 
-        prev_sep = is_separator(*p);
-        p++; i++;
+#define KILO_SYNTAX_THREADS 16
+#define KILO_SYNTAX_SMALL (1<<16)   /* fewer lines are scanned on one thread */
+
+struct syntax_job {
+    int from, to;           /* lines to scan */
+    int state;              /* state entering line <from>, maybe assumed */
+    unsigned char *oc;      /* state each line ends in, from line <from> on */
+};
+
+/* State line <row> ends in when entered in <state>: what it was highlighted
+   to if that still holds, else scanned using the <scratch> of <size> */
+static int editorLineState(struct line *row, int state, unsigned char **scratch, int *size) {
+    if (!row->hl_stale && row->hl_ic == state) return row->hl_oc;
+    if (row->chunks) return editorChunksState(row,state);
+    if (row->size > *size || !*scratch) {
+        *size = row->size ? row->size : 1;
+        *scratch = realloc(*scratch,*size);
     }
+    return editorHighlight(row->chars,row->size,*scratch,state);
+}
 
-    /* Propagate syntax change to next row if open comment state changed.
-       may recursively affect all following rows */
-    int oc = editorRowHasOpenComment(row);
-    if (row->hl_oc != oc && row->idx+1 < E.buffer.numlines)
-        editorUpdateSyntax(&E.buffer.lines[row->idx+1]);
-    row->hl_oc = oc;
+/* Only reads the lines, so runs on any thread while the editor waits */
+static void *syntax_worker(void *arg) {
+    struct syntax_job *job = arg;
+    unsigned char *scratch = NULL;
+    int size = 0, state = job->state, n;
+    for (int at = job->from; at < job->to; ) {
+        struct line *row = rope_span(&E.buffer.lines, at, &n);
+        for (int j = 0; j < n && at < job->to; j++, at++)
+            state = job->oc[at-job->from] = editorLineState(row+j, state, &scratch, &size);
+    }
+    free(scratch);
+    return NULL;
+}
+
+/* Work out the state lines <from>..<to> end in, entering <from> in
+   <state>; the line before <to> must exist.  Returns the last one. */
+static int editorScanLines(int from, int to, int state) {
+    struct syntax_job job[KILO_SYNTAX_THREADS];
+    pthread_t thread[KILO_SYNTAX_THREADS];
+    int started[KILO_SYNTAX_THREADS] = {0};
+    unsigned char *oc = malloc(to-from);
+    unsigned char *scratch = NULL;
+    int size = 0;
+
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > KILO_SYNTAX_THREADS) nthreads = KILO_SYNTAX_THREADS;
+    if (nthreads < 1 || to-from < KILO_SYNTAX_SMALL) nthreads = 1;
+    for (int i = 0; i < nthreads; i++) {
+        int start = from+(long long)(to-from)*i/nthreads;
+        job[i] = (struct syntax_job){start, from+(long long)(to-from)*(i+1)/nthreads,
+                                     i ? 0 : state, oc+(start-from)};
+    }
+    /* this thread does the first share itself */
+    for (int i = 1; i < nthreads; i++)
+        started[i] = pthread_create(&thread[i], NULL, syntax_worker, &job[i]) == 0;
+    syntax_worker(&job[0]);
+    for (int i = 1; i < nthreads; i++) {
+        if (started[i]) pthread_join(thread[i], NULL);
+        else syntax_worker(&job[i]);
+    }
+
+    /* fix up shares entered in another state than assumed */
+    for (int i = 1; i < nthreads; i++) {
+        int assumed = job[i].state, real = oc[job[i].from-1-from];
+        for (int at = job[i].from; at < job[i].to && real != assumed; at++) {
+            assumed = oc[at-from];
+            real = oc[at-from] = editorLineState(buffer_line(at), real, &scratch, &size);
+        }
+    }
+    free(scratch);
+
+    /* lines scanned again drop their highlights: redone when next drawn */
+    for (int at = from, n; at < to; ) {
+        struct line *row = rope_span(&E.buffer.lines, at, &n);
+        for (int j = 0; j < n && at < to; j++, at++) {
+            if (row[j].hl_stale || row[j].hl_ic != state) {
+                editorFreeHighlight(row+j);
+                row[j].hl_ic = state;
+                row[j].hl_oc = oc[at-from];
+                row[j].hl_stale = 0;
+            }
+            state = oc[at-from];
+        }
+    }
+    free(oc);
+    return state;
+}
+
+/* Bring the highlights of lines <first>..<last> (the screen) up to date.
+ *
+ * Every line checkpoints the state it was highlighted from (hl_ic) and the
+ * state it ends in (hl_oc).  Edits only mark a line stale and pull
+ * E.buffer.hl_stale back to it; here we walk forward from there, redoing a
+ * line when it was edited or when the line above now ends in a different
+ * state.  Lines above the screen only have their state recomputed, lines
+ * below it are left for when they scroll into view.  So opening a comment
+ * costs O(screen height), however many lines it swallows.
+ */
+void editorUpdateSyntax(int first, int last) {
+    int at = E.buffer.hl_stale < first ? E.buffer.hl_stale : first;
+    int state = at > 0 ? buffer_line(at-1)->hl_oc : 0;
+    struct line *row;
+
+    if (at < first) {
+        int to = buffer_line(first-1) ? first : E.buffer.numlines;
+        if (at < to) state = editorScanLines(at, to, state);
+        at = first;
+    }
+    for (; at <= last && (row = buffer_line(at)) != NULL; at++) {
+        if (row->hl_stale || row->hl_ic != state || !row->hl)
+            editorHighlightLine(at, state);
+        state = buffer_line(at)->hl_oc;
+    }
+    if (at > E.buffer.hl_stale) E.buffer.hl_stale = at;
 }
 
 int editorSyntaxToColor(int hl) {
@@ -223,6 +860,7 @@ void editorSelectSyntaxHighlight(char *filename) {
             int patlen = strlen(s->filematch[i]);
             if ((p = strstr(filename,s->filematch[i])) != NULL) {
                 if (s->filematch[i][0] != '.' || p[patlen] == '\0') {
+                    if (!s->lexer) s->lexer = editorCompileSyntax(s);
                     E.buffer.syntax = s;
                     return;
                 }
@@ -1,7 +1,13 @@
+struct line;
 
-void editorUpdateSyntax(struct line *);
+
+void editorUpdateSyntax(int, int);
 void editorSelectSyntaxHighlight(char*);
 int editorSyntaxToColor(int);
+void editorFreeHighlight(struct line *);
+int editorRenderCol(struct line *, int);
+int editorColAt(struct line *, int);
+int editorHighlightWindow(struct line *, int, int, char *, unsigned char *);
 
 /* Syntax highlight types */
 #define HL_NORMAL 0
@@ -13,6 +19,7 @@ int editorSyntaxToColor(int);
 #define HL_STRING 6
 #define HL_NUMBER 7
 #define HL_MATCH 8      /* Search match. */
+#define HL_CLASSES 9    /* how many of the above */
 
 #define HL_HIGHLIGHT_STRINGS (1<<0)
 #define HL_HIGHLIGHT_NUMBERS (1<<1)
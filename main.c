@@ -12,9 +12,12 @@ int main(int argc, char **argv) {
     }
     term_setup();
     buffer_find_file(argv[1]);
+    editor_theme(getenv("KILO_THEME"));
     while(1) {
         editor_refresh();
-        editor_process(term_read(STDIN_FILENO));
+        /* handle all input already typed or pasted before drawing again */
+        do editor_process(term_read(STDIN_FILENO));
+        while (term_pending(STDIN_FILENO));
     }
     return 0;
 }
@@ -8,25 +8,390 @@
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "draw.h"
 #include "term.h"
 #include "structures.h"
 #include "highlights.h"
+#include "process.h"
+#include "rope.h"
+#include "search.h"
+#include "regex.h"
+#include "slab.h"
+#include "chunk.h"
 
 struct editor E;
 
 /* ========================== Helper Funs ========================= */
 
+/* Files this large are mapped rather than read, and split into lines
+   only as far as the editor has looked */
+#define BUFFER_MMAP_SIZE (1UL<<30)
+
+/* Smaller files are read whole, this much at a time */
+#define BUFFER_READ_BLOCK (4UL<<20)
+
+/* A save running on a worker thread, see buffer_write() */
+static struct {
+    int running;        /* worker started and not yet joined */
+    pthread_t thread;
+    int notify[2];      /* the worker writes a byte here when done */
+    struct rope lines;  /* snapshot of the buffer being written */
+    int from;           /* first line to write */
+    const char *rest;   /* mapped bytes not split into lines yet, written after them */
+    size_t restlen;
+    int fd;
+    char *tmpname;      /* renamed over the file when written, NULL if saving in place */
+    char *path;         /* the file it is renamed over, symlinks resolved */
+    long long off, size; /* in place: lines go from <off> on, file cut to <size> */
+    long long len;      /* bytes written */
+    int err;            /* errno if the save failed */
+    int dirty, dirty_from; /* E.buffer's when the save started */
+    struct { char *chars; int cap; } *garbage; /* chars edited away from under the snapshot, freed when done */
+    int ngarbage, garbagecap;
+} save;
+
+/* The undo log: records of the edits made, back to back in one growing
+   arena, each only the text it inserted or deleted.  A record is a struct
+   undo_rec, its text, and its text length again so the log can be walked
+   both ways.  Undoing applies the inverse of the records before <top>,
+   redoing applies the ones after it again; a new edit drops those. */
+#define UNDO_INSERT 1       /* text inserted at row,col; \n broke lines */
+#define UNDO_DELETE 2       /* text deleted at row,col; \n joined lines */
+#define UNDO_INSERT_LINES 3 /* lines inserted at row, one per \n-separated text */
+#define UNDO_DELETE_LINES 4 /* lines deleted at row */
+
+struct undo_rec {
+    int type;
+    int seq;            /* command that made it: undone and redone together */
+    int row, col;
+    int len;            /* of the text following */
+    int nl;             /* \n in the text */
+};
+
+static struct {
+    char *data;
+    size_t len, cap;
+    size_t top;         /* records from here on are undone */
+    size_t begun;       /* record being written, see undo_begin() */
+    int seq;            /* current command, see editor_process() */
+    int off;            /* not recording: loading a file, undoing or nested edits */
+} undo;
+
+/* Record ending at <end> into *rec; returns where it starts */
+static size_t undo_before(size_t end, struct undo_rec *rec) {
+    int len;
+    memcpy(&len,undo.data+end-sizeof(int),sizeof(int));
+    end -= sizeof(int)+len+sizeof(*rec);
+    memcpy(rec,undo.data+end,sizeof(*rec));
+    return end;
+}
+
+/* Record starting at <start> into *rec; returns where it ends */
+static size_t undo_after(size_t start, struct undo_rec *rec) {
+    memcpy(rec,undo.data+start,sizeof(*rec));
+    return start+sizeof(*rec)+rec->len+sizeof(int);
+}
+
+static void undo_reserve(size_t need) {
+    if (need <= undo.cap) return;
+    undo.cap = undo.cap*2 > need ? undo.cap*2 : need;
+    undo.data = realloc(undo.data,undo.cap);
+}
+
+/* Start a record with room for <max> bytes of text, which it returns for
+   the caller to fill in before undo_end(); NULL when not recording */
+static char *undo_begin(int type, int row, int col, size_t max) {
+    if (undo.off) return NULL;
+    undo.len = undo.top;
+    undo_reserve(undo.len+sizeof(struct undo_rec)+max+sizeof(int));
+    struct undo_rec rec = {type,undo.seq,row,col,0,0};
+    memcpy(undo.data+undo.len,&rec,sizeof(rec));
+    undo.begun = undo.len;
+    return undo.data+undo.len+sizeof(rec);
+}
+
+/* Write out the header and length of the record at <start>, the last one */
+static void undo_close(size_t start, struct undo_rec *rec) {
+    memcpy(undo.data+start,rec,sizeof(*rec));
+    memcpy(undo.data+start+sizeof(*rec)+rec->len,&rec->len,sizeof(int));
+    undo.len = undo.top = start+sizeof(*rec)+rec->len+sizeof(int);
+}
+
+/* Finish the record begun last, with <len> bytes of text */
+static void undo_end(size_t len) {
+    struct undo_rec rec;
+    memcpy(&rec,undo.data+undo.begun,sizeof(rec));
+    rec.len = len;
+    rec.nl = search_count(undo.data+undo.begun+sizeof(rec),len,'\n');
+    undo_close(undo.begun,&rec);
+}
+
+/* Fold an edit into the last record if it continues it, eg. typing a word,
+   backspacing over one or killing line after line, so that such a run is
+   undone as one and costs one record header. */
+static int undo_merge(int type, int row, int col, const char *s, size_t len) {
+    struct undo_rec last;
+    if (!undo.top || undo.len != undo.top) return 0;
+    size_t start = undo_before(undo.top,&last);
+    if (last.type != type || last.seq < undo.seq-1) return 0;
+
+    int append, sep = 0;
+    switch (type) {
+    case UNDO_INSERT:
+        append = 1;
+        if (row != last.row || col != last.col+last.len) return 0;
+        if (last.nl || memchr(s,'\n',len)) return 0;
+        break;
+    case UNDO_DELETE:
+        if (row != last.row || last.nl || memchr(s,'\n',len)) return 0;
+        if (col == last.col) append = 1;                /* delete forward */
+        else if (col+(int)len == last.col) append = 0;  /* delete backward */
+        else return 0;
+        break;
+    case UNDO_INSERT_LINES:
+        append = sep = 1;
+        if (row != last.row+last.nl+1) return 0;
+        break;
+    case UNDO_DELETE_LINES:
+        append = sep = 1;
+        if (row != last.row) return 0;
+        break;
+    default:
+        return 0;
+    }
+
+    /* the record is last in the log: its text grows in place */
+    size_t newlen = last.len+sep+len;
+    undo_reserve(start+sizeof(last)+newlen+sizeof(int));
+    char *text = undo.data+start+sizeof(last);
+    if (append) {
+        if (sep) text[last.len] = '\n';
+        memcpy(text+last.len+sep,s,len);
+    } else {
+        memmove(text+len,text,last.len);
+        memcpy(text,s,len);
+        last.col = col;
+    }
+    last.seq = undo.seq;
+    last.len = newlen;
+    last.nl += sep;
+    undo_close(start,&last);
+    return 1;
+}
+
+/* Note an edit in the undo log */
+static void undo_record(int type, int row, int col, const char *s, size_t len) {
+    if (undo.off || undo_merge(type,row,col,s,len)) return;
+    char *text = undo_begin(type,row,col,len);
+    memcpy(text,s,len);
+    undo_end(len);
+}
+
+/* Columns <line> takes drawn: line->rsize once rendered or measured, see
+   buffer_render_line() */
+static int buffer_line_width(struct line *line) {
+    if (line->rsize >= 0) return line->rsize;
+    if (line->chunks) return editorRenderCol(line,line->size);
+    int idx = 0;
+    const char *s = line->chars, *end = s+line->size, *tab;
+    while ((tab = memchr(s,TAB,end-s))) {
+        idx += tab-s+1;
+        while((idx+1) % 8 != 0) idx++;
+        s = tab+1;
+    }
+    return idx + (end-s);
+}
+
+/* Split the mapped file into lines until line <upto> exists or the mapping is
+   used up.  Lines are not rendered: their chars point into the mapping. */
+static void buffer_index_lines(int upto) {
+    struct mapping *map = &E.buffer.map;
+    while (E.buffer.numlines <= upto && map->indexed < map->len) {
+        char *start = map->data+map->indexed;
+        char *nl = memchr(start,'\n',map->len-map->indexed);
+        size_t len = nl ? (size_t)(nl-start) : map->len-map->indexed;
+        map->indexed += len + (nl != NULL);
+        /* as buffer_load_file() does: a last line without \n loses a \r */
+        if (!nl && len && start[len-1] == '\r') len--;
+
+        struct line *line = rope_insert(&E.buffer.lines, E.buffer.numlines++, len);
+        line->cap = 0;
+        line->chars = start;
+        line->hl = NULL;
+        line->hl_ic = line->hl_oc = 0;
+        line->hl_stale = 1;
+        line->pinned = 0;
+        line->render = NULL;
+        line->rsize = -1;
+        line->chunks = NULL;
+        if (E.buffer.lines.wrap) {
+            /* soft wrapping: the rows it takes count from the start */
+            line->rsize = buffer_line_width(line);
+            rope_update(&E.buffer.lines,E.buffer.numlines-1);
+        }
+    }
+}
+
+/* Does the line still point into the mapped file? */
+static int buffer_line_mapped(struct line *line) {
+    return line->cap == 0;
+}
+
+/* Free chars once no save needs them */
+static void buffer_free_chars(struct line *line) {
+    if (!line->pinned || !save.running) {
+        slab_free(&E.buffer.store,line->chars,line->cap);
+        return;
+    }
+    if (save.ngarbage == save.garbagecap) {
+        save.garbagecap = save.garbagecap ? save.garbagecap*2 : 64;
+        save.garbage = realloc(save.garbage,sizeof(*save.garbage)*save.garbagecap);
+    }
+    save.garbage[save.ngarbage].chars = line->chars;
+    save.garbage[save.ngarbage++].cap = line->cap;
+}
+
+/* Make room for <need> chars in a line of our own, growing it by half
+   again at least so that typing along a line copies it rarely */
+static void buffer_reserve_line(struct line *line, size_t need) {
+    if (need <= (size_t)line->cap) return;
+    if (need < (size_t)line->cap+line->cap/2) need = line->cap+line->cap/2;
+    char *chars = slab_alloc(&E.buffer.store,need);
+    memcpy(chars,line->chars,line->size+1);
+    slab_free(&E.buffer.store,line->chars,line->cap);
+    if (line->render == line->chars) line->render = chars;
+    line->chars = chars;
+    line->cap = slab_size(need);
+}
+
+/* Copy a chunked line back into chars of its own, whole, that its
+   chunks point into from then on: see chunk.c */
+static void buffer_compact_line(struct line *line) {
+    char *chars = slab_alloc(&E.buffer.store,line->size+1);
+    chunk_rebase(line,chars);
+    if (!buffer_line_mapped(line)) buffer_free_chars(line);
+    line->chars = chars;
+    line->cap = slab_size(line->size+1);
+    line->pinned = 0;
+}
+
+/* Give a line chars of its own before editing them: copy them to the
+   heap if they are in the mapped file or shared with a save */
+static void buffer_own_line(struct line *line) {
+    int mapped = buffer_line_mapped(line);
+    if (!mapped && !(line->pinned && save.running)) {
+        line->pinned = 0;
+        return;
+    }
+    if (line->chunks) {
+        buffer_compact_line(line);
+        return;
+    }
+    char *chars = slab_alloc(&E.buffer.store,line->size+1);
+    memcpy(chars,line->chars,line->size);
+    chars[line->size] = '\0';
+    if (!mapped) buffer_free_chars(line);
+    if (line->render == line->chars) line->render = chars;
+    line->chars = chars;
+    line->cap = slab_size(line->size+1);
+    line->pinned = 0;
+}
+
+/* Line <at> of the buffer, NULL past the end */
+struct line *buffer_line(int at) {
+    if (at >= E.buffer.numlines) buffer_index_lines(at);
+    return rope_get(&E.buffer.lines, at);
+}
+
+/* Line <at> of the buffer for changing its chars, in one piece again
+   if it was chunked */
+static struct line *buffer_edit_line(int at) {
+    if (!buffer_line(at)) return NULL;
+    struct line *line = rope_get_mut(&E.buffer.lines, at);
+    if (line->chunks) {
+        if (!line->chunks->flat) buffer_compact_line(line);
+        chunk_free(line);
+    }
+    buffer_own_line(line);
+    return line;
+}
+
+/* Line <at>, with line->chars holding all of it even if it is chunked */
+static struct line *buffer_flat_line(int at) {
+    struct line *line = buffer_line(at);
+    if (line && line->chunks && !line->chunks->flat) {
+        line = rope_get_mut(&E.buffer.lines, at);
+        buffer_compact_line(line);
+    }
+    return line;
+}
+
+/* Make every line whole in line->chars, for code that reads them as such */
+static void buffer_compact_lines(void) {
+    for (int j = 0, n; E.buffer.ragged && j < E.buffer.numlines; j += n) {
+        struct line *line = rope_span(&E.buffer.lines, j, &n);
+        for (int k = 0; k < n; k++) {
+            if (line[k].chunks && !line[k].chunks->flat) {
+                buffer_flat_line(j+k);
+                n = k+1;    /* the span may have moved */
+                break;
+            }
+        }
+    }
+}
+
+/* Is the whole file split into lines, ie. is numlines final? */
+int buffer_indexed(void) {
+    return E.buffer.map.indexed == E.buffer.map.len;
+}
+
+/* Line <at> changed, or lines were inserted or deleted there */
+static void buffer_modified(int at) {
+    E.buffer.dirty++;
+    if (at < E.buffer.dirty_from) E.buffer.dirty_from = at;
+}
+
+/* Free line->render unless it is the chars themselves */
+static void buffer_free_render(struct line *line) {
+    if (line->render != line->chars)
+        slab_free(&E.buffer.store,line->render,line->rsize+1);
+    line->render = NULL;
+}
+
 /* Update line->render, line->highlight */
-void buffer_render_line(struct line *line) {
+void buffer_render_line(int at) {
+    struct line *line = buffer_line(at);
     unsigned int tabs = 0, nonprint = 0;
     int j, idx;
 
    /* re-render line: respect tabs, sub non printable with '?' */
-    free(line->render);
+    buffer_free_render(line);
+    editorFreeHighlight(line);
+
+    /* a long line is drawn from its chunks, a screenful at a time.  Its
+       width takes a pass over them if it has tabs: only when soft wrapping. */
+    if (line->chunks || line->size >= CHUNK_LINE) {
+        if (!line->chunks) chunk_line(line);
+        line->rsize = !line->chunks->tabs ? line->size :
+            E.buffer.lines.wrap ? editorRenderCol(line,line->size) : -1;
+        goto stale;
+    }
+
+    /* without tabs the rendered line is the line: share its chars, which
+       may be in the mapped file and so are not always \0 terminated */
+    if (!memchr(line->chars,TAB,line->size)) {
+        line->render = line->chars;
+        line->rsize = line->size;
+        goto stale;
+    }
     for (j = 0; j < line->size; j++)
         if (line->chars[j] == TAB) tabs++;
 
@@ -38,7 +403,13 @@ void buffer_render_line(struct line *line) {
         exit(1);
     }
 
-    line->render = malloc(line->size + tabs*8 + nonprint*9 + 1);
+    /* tabs take up to 8 columns: count the exact size first */
+    for (idx = 0, j = 0; j < line->size; j++) {
+        idx++;
+        if (line->chars[j] == TAB)
+            while((idx+1) % 8 != 0) idx++;
+    }
+    line->render = slab_alloc(&E.buffer.store,idx+1);
     idx = 0;
     for (j = 0; j < line->size; j++) {
         if (line->chars[j] == TAB) {
@@ -51,194 +422,602 @@ void buffer_render_line(struct line *line) {
     line->rsize = idx;
     line->render[idx] = '\0';
 
-    editorUpdateSyntax(line);
+stale:
+    /* highlighted when next drawn, see editorUpdateSyntax() */
+    line->hl_stale = 1;
+    if (at < E.buffer.hl_stale) E.buffer.hl_stale = at;
+    rope_update(&E.buffer.lines,at);
 }
 
 void buffer_insert_line(int at, char *s, size_t len) {
     if (at > E.buffer.numlines) return;
-    E.buffer.lines = realloc(E.buffer.lines,sizeof(struct line)*(E.buffer.numlines+1));
-    if (at != E.buffer.numlines) {
-        memmove(E.buffer.lines+at+1,E.buffer.lines+at,sizeof(E.buffer.lines[0])*(E.buffer.numlines-at));
-        for (int j = at+1; j <= E.buffer.numlines; j++) E.buffer.lines[j].idx++;
-    }
-    struct line *line = E.buffer.lines+at;
-    line->size = len;
-    line->chars = malloc(len+1);
-    memcpy(line->chars,s,len+1);
+    struct line *line = rope_insert(&E.buffer.lines, at, len);
+    line->chars = slab_alloc(&E.buffer.store,len+1);
+    line->cap = slab_size(len+1);
+    memcpy(line->chars,s,len);
+    line->chars[len] = '\0';
     line->hl = NULL;
-    line->hl_oc = 0;
+    line->hl_ic = line->hl_oc = 0;
+    line->pinned = 0;
     line->render = NULL;
-    line->rsize = 0;
-    line->idx = at;
-    buffer_render_line(line);
+    line->rsize = -1;
+    line->chunks = NULL;
     E.buffer.numlines++;
-    E.buffer.dirty++;
+    buffer_render_line(at);
+    buffer_modified(at);
+    undo_record(UNDO_INSERT_LINES,at,0,s,len);
 }
 
 void buffer_free_line(struct line *line) {
-    free(line->render);
-    free(line->chars);
-    free(line->hl);
+    buffer_free_render(line);
+    chunk_free(line);
+    if (!buffer_line_mapped(line)) buffer_free_chars(line);
+    editorFreeHighlight(line);
 }
+
+static void buffer_write_done(void);
+static void buffer_write_wait(void);
 void buffer_clear(void) {
+  buffer_write_wait();
   E.buffer.point.col = E.buffer.point.row = 0;
   E.buffer.offset.col = E.buffer.offset.row = 0;
+  E.buffer.wrap_top = 0;
   /* E.buffer.syntax = NULL; */
   E.buffer.dirty = 0;
-  for (int i=0; i<E.buffer.numlines; ++i) {
-    buffer_free_line(E.buffer.lines+i);
-  }
+  E.buffer.dirty_from = INT_MAX;
+  E.buffer.hl_stale = 0;
+  /* every line's storage goes at once */
+  slab_free_all(&E.buffer.store);
+  rope_free(&E.buffer.lines);
   E.buffer.numlines = 0;
+  E.buffer.ragged = 0;
+  free(undo.data);
+  undo.data = NULL;
+  undo.len = undo.cap = undo.top = 0;
+  if (E.buffer.map.data) munmap(E.buffer.map.data, E.buffer.map.len);
+  memset(&E.buffer.map, 0, sizeof(E.buffer.map));
 }
 
 static void editor_point_fix(void);
 void buffer_kill_line(int at) {
-    struct line *row;
-    if (at >= E.buffer.numlines) return;
-    row = E.buffer.lines+at;
-    buffer_free_line(row);
-    memmove(E.buffer.lines+at,E.buffer.lines+at+1,sizeof(E.buffer.lines[0])*(E.buffer.numlines-at-1));
-    for (int j = at; j < E.buffer.numlines-1; j++) E.buffer.lines[j].idx--;
+    if (!buffer_line(at)) return;
+    buffer_flat_line(at);
+    struct line *line = rope_get_mut(&E.buffer.lines, at);
+    undo_record(UNDO_DELETE_LINES,at,0,line->chars,line->size);
+    buffer_free_line(line);
+    rope_delete(&E.buffer.lines, at);
     E.buffer.numlines--;
-    E.buffer.dirty++;
+    if (at < E.buffer.hl_stale) E.buffer.hl_stale = at;
+    buffer_modified(at);
     editor_point_fix();
 }
 void buffer_kill_line_interactive(void) {
   buffer_kill_line(E.buffer.point.row + E.buffer.offset.row);
 }
 
-void editorRowInsertChar(struct line *row, int at, int c) {
+/* Replace <del> chars of chunked line <filerow> at <at> by s[0..len) */
+static void buffer_splice_line(int filerow, int at, int del, const char *s, int len) {
+    struct line *line = rope_get_mut(&E.buffer.lines, filerow);
+    chunk_splice(line,at,del,s,len);
+    line->size += len-del;
+    buffer_render_line(filerow);
+    buffer_modified(filerow);
+}
+
+void editorRowInsertChar(int filerow, int at, int c) {
+    struct line *row = buffer_line(filerow);
+    int from = at < row->size ? at : row->size;
+    if (row->chunks) {
+        char *s = malloc(at-from+1);
+        memset(s,' ',at-from);
+        s[at-from] = c;
+        buffer_splice_line(filerow,from,0,s,at-from+1);
+        undo_record(UNDO_INSERT,filerow,from,s,at-from+1);
+        free(s);
+        return;
+    }
+    row = buffer_edit_line(filerow);
     if (at > row->size) {
         /* Pad string with spaces if insert location outside current length by more than a single character. */
         int padlen = at-row->size;
-        row->chars = realloc(row->chars,row->size+padlen+2);
+        buffer_reserve_line(row,row->size+padlen+2);
         memset(row->chars+row->size,' ',padlen);
         row->chars[row->size+padlen+1] = '\0';
         row->size += padlen+1;
     } else {
-        row->chars = realloc(row->chars,row->size+2);
+        buffer_reserve_line(row,row->size+2);
         memmove(row->chars+at+1,row->chars+at,row->size-at+1);
         row->size++;
     }
     row->chars[at] = c;
-    buffer_render_line(row);
-    E.buffer.dirty++;
+    buffer_render_line(filerow);
+    buffer_modified(filerow);
+    /* any padding goes with the char */
+    undo_record(UNDO_INSERT,filerow,from,row->chars+from,at-from+1);
 }
 
-void editorRowAppendString(struct line *row, char *s, size_t len) {
-    row->chars = realloc(row->chars,row->size+len+1);
+void editorRowAppendString(int filerow, char *s, size_t len) {
+    struct line *row = buffer_edit_line(filerow);
+    buffer_reserve_line(row,row->size+len+1);
     memcpy(row->chars+row->size,s,len);
     row->size += len;
     row->chars[row->size] = '\0';
-    buffer_render_line(row);
-    E.buffer.dirty++;
+    buffer_render_line(filerow);
+    buffer_modified(filerow);
+    undo_record(UNDO_INSERT,filerow,row->size-len,s,len);
 }
 
-void editorRowDelChar(struct line *line, int at) {
+void editorRowDelChar(int filerow, int at) {
+    struct line *line = buffer_line(filerow);
     if (line->size <= at) return;
+    if (line->chunks) {
+        int n;
+        char c = *chunk_span(line,at,&n);
+        undo_record(UNDO_DELETE,filerow,at,&c,1);
+        buffer_splice_line(filerow,at,1,NULL,0);
+        return;
+    }
+    line = buffer_edit_line(filerow);
+    undo_record(UNDO_DELETE,filerow,at,line->chars+at,1);
     memmove(line->chars+at, line->chars+at+1, line->size-at);
-    buffer_render_line(line);
     line->size--;
-    E.buffer.dirty++;
+    buffer_render_line(filerow);
+    buffer_modified(filerow);
 }
 
 /* ========================== Search Commands ========================= */
 
 #define KILO_QUERY_LEN 256
-/* static void editorFind() { */
-/*     int fd = 1; */
-/*     char query[KILO_QUERY_LEN+1] = {0}; */
-/*     int qlen = 0; */
-/*     int last_match = -1; /\* Last line where a match was found. -1 for none. *\/ */
-/*     int find_next = 0; /\* if 1 search next, if -1 search prev. *\/ */
-/*     int saved_hl_line = -1;  /\* No saved HL *\/ */
-/*     char *saved_hl = NULL; */
-
-/* #define FIND_RESTORE_HL do { \ */
-/*     if (saved_hl) { \ */
-/*         memcpy(E.buffer.lines[saved_hl_line].hl,saved_hl, E.buffer.lines[saved_hl_line].rsize); \ */
-/*         free(saved_hl); \ */
-/*         saved_hl = NULL; \ */
-/*     } \ */
-/* } while (0) */
-
-/*     /\* save-excursion *\/ */
-/*     int saved_point_col = E.buffer.point.col, saved_point_row = E.buffer.point.row; */
-/*     int saved_offset_col = E.buffer.offset.col, saved_offset_row = E.buffer.offset.row; */
-
-/*     while(1) { */
-/*         editor_message("Search: %s (Use ESC/Arrows/Enter)", query); */
-/*         editor_refresh(); */
-
-/*         int c = term_read(fd); */
-/*         if (c == CTRL_H || c == DEL) { */
-/*             if (qlen != 0) query[--qlen] = '\0'; */
-/*             last_match = -1; */
-/*         } else if (c == ESC || c == CTRL_M) { */
-/*             if (c == ESC) { */
-/*                 E.buffer.point.col = saved_point_col; E.buffer.point.row = saved_point_row; */
-/*                 E.buffer.offset.col = saved_offset_col; E.buffer.offset.row = saved_offset_row; */
-/*             } */
-/*             FIND_RESTORE_HL; */
-/*             editor_message(""); */
-/*             return; */
-/*         } else if (c == CTRL_F || c == CTRL_N) { */
-/*             find_next = 1; */
-/*         } else if (c == CTRL_B || c == CTRL_P) { */
-/*             find_next = -1; */
-/*         } else if (isprint(c)) { */
-/*             if (qlen < KILO_QUERY_LEN) { */
-/*                 query[qlen++] = c; */
-/*                 query[qlen] = '\0'; */
-/*                 last_match = -1; */
-/*             } */
-/*         } */
-
-/*         /\* Search occurrence. *\/ */
-/*         if (last_match == -1) find_next = 1; */
-/*         if (find_next) { */
-/*             char *match = NULL; */
-/*             int match_offset = 0; */
-/*             int i, current = last_match; */
-
-/*             for (i = 0; i < E.buffer.numlines; i++) { */
-/*                 current += find_next; */
-/*                 if (current == -1) current = E.buffer.numlines-1; */
-/*                 else if (current == E.buffer.numlines) current = 0; */
-/*                 match = strstr(E.buffer.lines[current].render,query); */
-/*                 if (match) { */
-/*                     match_offset = match-E.buffer.lines[current].render; */
-/*                     break; */
-/*                 } */
-/*             } */
-/*             find_next = 0; */
-
-/*             /\* Highlight *\/ */
-/*             FIND_RESTORE_HL; */
-
-/*             if (match) { */
-/*                 struct line *row = &E.buffer.lines[current]; */
-/*                 last_match = current; */
-/*                 if (row->hl) { */
-/*                     saved_hl_line = current; */
-/*                     saved_hl = malloc(row->rsize); */
-/*                     memcpy(saved_hl,row->hl,row->rsize); */
-/*                     memset(row->hl+match_offset,HL_MATCH,qlen); */
-/*                 } */
-/*                 E.buffer.point.row = 0; */
-/*                 E.buffer.point.col = match_offset; */
-/*                 E.buffer.offset.row = current; */
-/*                 E.buffer.offset.col = 0; */
-/*                 /\* Scroll horizontally as needed. *\/ */
-/*                 if (E.buffer.point.col > E.terminal.winsize.col) { */
-/*                     int diff = E.buffer.point.col - E.terminal.winsize.col; */
-/*                     E.buffer.point.col -= diff; */
-/*                     E.buffer.offset.col += diff; */
-/*                 } */
-/*             } */
-/*         } */
-/*     } */
-/* } */
+
+static void editor_point_set(int filerow, int filecol);
+
+/* Find <q> in lines [from,to), starting at column <col> of line <from>.
+   Runs of lines lying back to back in memory, as unedited lines of a
+   mapped file do, are searched in one go: a match cannot span the \n or
+   \0 that separates them, as a query is printable. */
+static int editor_find_forward(const char *q, int qlen, int from, int col, int to, struct point *found) {
+    for (int j = from, n; j < to; j += n) {
+        struct line *line = rope_span(&E.buffer.lines, j, &n);
+        if (!line) break;
+        if (n > to-j) n = to-j;
+        for (int k = 0, end; k < n; k = end+1) {
+            for (end = k; end+1 < n && line[end+1].chars == line[end].chars+line[end].size+1; end++);
+            const char *s = line[k].chars, *e = line[end].chars+line[end].size;
+            if (j+k == from) s += col < line[k].size ? col : line[k].size;
+            const char *p = search_forward(s, e-s, q, qlen);
+            if (!p) continue;
+            while (p > line[k].chars+line[k].size) k++;
+            found->row = j+k;
+            found->col = p-line[k].chars;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Find <q> in lines <from> down to <to>, starting before column <col> of line <from> */
+static int editor_find_backward(const char *q, int qlen, int from, int col, int to, struct point *found) {
+    for (int j = from; j >= to; j--) {
+        struct line *line = buffer_line(j);
+        int n = line->size;
+        if (j == from && col < n-qlen+1) n = col+qlen-1;
+        const char *p = search_backward(line->chars, n < 0 ? 0 : n, q, qlen);
+        if (p) {
+            found->row = j;
+            found->col = p-line->chars;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Next match of <q> from *at on, in direction <dir>, wrapping around the
+   end of the buffer.  The part of a mapped file not split into lines yet
+   is searched as it is, and only split up to a match. */
+static int editor_find(const char *q, int qlen, int dir, struct point *at) {
+    struct mapping *map = &E.buffer.map;
+    struct point found;
+    if (dir > 0) {
+        if (editor_find_forward(q, qlen, at->row, at->col, E.buffer.numlines, &found)) goto done;
+        if (!buffer_indexed()) {
+            const char *p = search_forward(map->data+map->indexed, map->len-map->indexed, q, qlen);
+            if (p) {
+                while (map->indexed <= (size_t)(p-map->data)) buffer_index_lines(E.buffer.numlines);
+                found.row = E.buffer.numlines-1;
+                found.col = p-buffer_line(found.row)->chars;
+                goto done;
+            }
+        }
+        if (editor_find_forward(q, qlen, 0, 0, at->row+1, &found)) goto done;
+    } else {
+        if (at->row < E.buffer.numlines &&
+            editor_find_backward(q, qlen, at->row, at->col, 0, &found)) goto done;
+        buffer_index_lines(INT_MAX);
+        if (editor_find_backward(q, qlen, E.buffer.numlines-1, INT_MAX, at->row, &found)) goto done;
+    }
+    return 0;
+done:
+    *at = found;
+    return 1;
+}
+
+/* Keep at most this many matches: past it only the count is kept, and
+   next and previous fall back to editor_find() */
+#define KILO_MATCH_MAX (1<<21)
+/* Threads finding all matches, and lines+mapped bytes/64 below which one will do */
+#define KILO_FIND_THREADS 16
+#define KILO_FIND_SMALL (1<<16)
+
+/* A share of the buffer searched by one thread: lines [from,to), then
+   the bytes start..end of the mapped file not split into lines yet */
+struct find_job {
+    const char *q;
+    int qlen;
+    int from, to;
+    const char *start, *end;
+    int rows;               /* \n in start..end */
+    struct found *found;    /* matches in lines, then in bytes with rows from <start> */
+    int n, inlines, cap;
+    int count;
+    int *budget;            /* matches all jobs may still keep, shared */
+};
+
+static void find_add(struct find_job *job, int row, int col, const char *chars) {
+    job->count++;
+    if (job->cap < 0) return;
+    if (job->n == job->cap) {
+        /* claim room from the shared budget; once spent, only count */
+        int more = job->cap ? job->cap : 256;
+        if (__sync_sub_and_fetch(job->budget, more) < 0) {
+            job->cap = -1;
+            return;
+        }
+        job->cap += more;
+        job->found = realloc(job->found, sizeof(struct found)*job->cap);
+    }
+    job->found[job->n++] = (struct found){row, col, chars};
+}
+
+/* Only reads lines and the mapping: the main thread leaves both alone
+   until it has joined every worker */
+static void *find_worker(void *arg) {
+    struct find_job *job = arg;
+    const char *q = job->q;
+    int qlen = job->qlen;
+
+    for (int j = job->from, n; j < job->to; j += n) {
+        struct line *line = rope_span(&E.buffer.lines, j, &n);
+        if (n > job->to-j) n = job->to-j;
+        for (int k = 0, end; k < n; k = end+1) {
+            for (end = k; end+1 < n && line[end+1].chars == line[end].chars+line[end].size+1; end++);
+            const char *s = line[k].chars, *e = line[end].chars+line[end].size, *p;
+            for (int i = k; (p = search_forward(s, e-s, q, qlen)) != NULL; s = p+1) {
+                while (p > line[i].chars+line[i].size) i++;
+                find_add(job, j+i, p-line[i].chars, p);
+            }
+        }
+    }
+    job->inlines = job->n;
+
+    /* \n are counted once, from the previous match on: counting from the
+       start of the line would go over a long line again for each match */
+    const char *s = job->start, *bol = s, *counted = s, *p;
+    int row = 0;
+    for (; (p = search_forward(s, job->end-s, q, qlen)) != NULL; s = p+1) {
+        if (job->cap < 0) {
+            job->count++; /* too many to keep: only counting, rows don't matter */
+            continue;
+        }
+        int nl = search_count(counted, p-counted, '\n');
+        if (nl) {
+            row += nl;
+            for (bol = p; bol[-1] != '\n'; bol--);
+        }
+        counted = p;
+        find_add(job, row, p-bol, p);
+    }
+    if (job->cap >= 0) job->rows = row + search_count(counted, job->end-counted, '\n');
+    return NULL;
+}
+
+/* Find every match of <q> in the buffer into E.match.all, splitting the
+   lines and the unindexed part of the mapping between threads */
+static void editor_find_all(const char *q, int qlen) {
+    struct mapping *map = &E.buffer.map;
+    struct find_job job[KILO_FIND_THREADS];
+    pthread_t thread[KILO_FIND_THREADS];
+    int started[KILO_FIND_THREADS] = {0};
+    size_t rest = map->len - map->indexed;
+    int budget = KILO_MATCH_MAX;
+
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > KILO_FIND_THREADS) nthreads = KILO_FIND_THREADS;
+    if (nthreads < 1 || E.buffer.numlines + rest/64 < KILO_FIND_SMALL) nthreads = 1;
+
+    const char *start = rest ? map->data+map->indexed : NULL, *end = start;
+    for (int i = 0; i < nthreads; i++) {
+        if (rest) {
+            /* cut the bytes after a \n so that every share starts a line */
+            const char *cut = map->data+map->indexed + rest*(i+1)/nthreads;
+            if (cut < start) cut = start;
+            if (i == nthreads-1 || !(cut = memchr(cut, '\n', map->data+map->len-cut)))
+                cut = map->data+map->len;
+            else
+                cut++;
+            end = cut;
+        }
+        job[i] = (struct find_job){q, qlen,
+            (long long)E.buffer.numlines*i/nthreads, (long long)E.buffer.numlines*(i+1)/nthreads,
+            start, end, 0, NULL, 0, 0, 0, 0, &budget};
+        start = end;
+    }
+    /* this thread does the first share itself */
+    for (int i = 1; i < nthreads; i++)
+        started[i] = pthread_create(&thread[i], NULL, find_worker, &job[i]) == 0;
+    find_worker(&job[0]);
+    for (int i = 1; i < nthreads; i++) {
+        if (started[i]) pthread_join(thread[i], NULL);
+        else find_worker(&job[i]);
+    }
+
+    free(E.match.all);
+    E.match.all = NULL;
+    E.match.count = 0;
+    int overflow = 0;
+    for (int i = 0; i < nthreads; i++) {
+        E.match.count += job[i].count;
+        overflow |= job[i].cap < 0;
+    }
+    if (!overflow && E.match.count) {
+        /* matches in lines come first, then those in the bytes beyond */
+        struct found *all = E.match.all = malloc(sizeof(struct found)*E.match.count);
+        for (int i = 0; i < nthreads; i++) {
+            memcpy(all, job[i].found, sizeof(struct found)*job[i].inlines);
+            all += job[i].inlines;
+        }
+        for (int i = 0, row = E.buffer.numlines; i < nthreads; row += job[i++].rows)
+            for (int j = job[i].inlines; j < job[i].n; j++) {
+                *all = job[i].found[j];
+                all++->row += row;
+            }
+    }
+    for (int i = 0; i < nthreads; i++) free(job[i].found);
+}
+
+/* Keep the matches of <q> among those of its first qlen-1 chars */
+static void editor_find_narrow(const char *q, int qlen) {
+    const char *data = E.buffer.map.data, *end = data+E.buffer.map.len;
+    int n = 0;
+    for (int i = 0; i < E.match.count; i++) {
+        const char *p = E.match.all[i].chars;
+        /* lines end in \n or \0, which no query char matches, bar the last mapped one */
+        if (p+qlen-1 == end && p >= data && p < end) continue;
+        if (p[qlen-1] == q[qlen-1]) E.match.all[n++] = E.match.all[i];
+    }
+    E.match.count = n;
+}
+
+/* Index of the first match at or after row, col: count if none */
+int editor_match_index(int row, int col) {
+    int lo = 0, hi = E.match.count;
+    while (lo < hi) {
+        int mid = lo + (hi-lo)/2;
+        struct found *f = E.match.all+mid;
+        if (f->row < row || (f->row == row && f->col < col)) lo = mid+1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Incremental search: each char typed searches on from the current match,
+   C-f/C-n and C-b/C-p go to the next and previous ones, ESC goes back.
+   All matches are found as the query changes, so the mode line can tell
+   which one of how many is current and stepping through them is a lookup. */
+static void editorFind(void) {
+    char query[KILO_QUERY_LEN+1] = {0};
+    int qlen = 0, found = 1;
+
+    /* save-excursion */
+    struct point saved_point = E.buffer.point, saved_offset = E.buffer.offset;
+    struct point start = {saved_offset.row+saved_point.row, saved_offset.col+saved_point.col};
+    struct point at = start;
+
+    buffer_compact_lines();
+    while(1) {
+        editor_message(found ? "Search: %s (Use ESC/Arrows/Enter)" : "Search: %s (not found)", query);
+        editor_refresh();
+
+        int c = term_read(STDIN_FILENO), dir = 0, changed = 0, grown = 0;
+        if (c == NOTIFY) {
+            buffer_write_done();
+        } else if (c == CTRL_H || c == DEL) {
+            if (qlen != 0) query[--qlen] = '\0';
+            at = start;
+            dir = changed = 1;
+        } else if (c == ESC || c == CTRL_M) {
+            if (c == ESC) {
+                E.buffer.point = saved_point;
+                E.buffer.offset = saved_offset;
+            }
+            free(E.match.all);
+            E.match.all = NULL;
+            E.match.count = E.match.len = 0;
+            editor_message("");
+            return;
+        } else if (c == CTRL_F || c == CTRL_N) {
+            dir = 1;
+        } else if (c == CTRL_B || c == CTRL_P) {
+            dir = -1;
+        } else if (c < 256 && isprint(c) && qlen < KILO_QUERY_LEN) {
+            query[qlen++] = c;
+            query[qlen] = '\0';
+            dir = changed = grown = 1;
+        }
+        if (!dir) continue;
+
+        if (changed) {
+            /* a longer query only drops matches, unless they were too many to keep */
+            if (grown && qlen > 1 && (E.match.all || !E.match.count))
+                editor_find_narrow(query, qlen);
+            else if (qlen)
+                editor_find_all(query, qlen);
+            else
+                E.match.count = 0;
+        }
+        found = qlen == 0 || E.match.count;
+        E.match.len = 0;
+        if (!qlen || !E.match.count) continue;
+
+        if (E.match.all) {
+            int k = changed ? editor_match_index(at.row, at.col) : E.match.k+dir;
+            k = (k+E.match.count) % E.match.count;
+            at.row = E.match.all[k].row;
+            at.col = E.match.all[k].col;
+            E.match.k = k;
+        } else {
+            if (!changed && dir > 0) at.col++;
+            editor_find(query, qlen, dir, &at);
+        }
+        E.match.row = at.row;
+        E.match.col = at.col;
+        E.match.len = qlen;
+        editor_point_set(at.row, at.col);
+    }
+}
+
+/* Mapped bytes not split into lines yet, searched between looks at the keyboard */
+#define KILO_REGEX_CHUNK (16UL<<20)
+
+/* Match of <re> in line <at>, see regex_match() */
+static int editor_match_line(struct regex *re, int at, size_t from, int dir, struct point *found, int *len) {
+    struct line *line = buffer_line(at);
+    size_t start, n;
+    if (!regex_match(re, line->chars, line->size, from, dir, &start, &n)) return 0;
+    found->row = at;
+    found->col = start;
+    *len = n;
+    return 1;
+}
+
+/* Next match of <re> from *at on in direction <dir>, wrapping around the
+   end of the buffer, into *at and *len.  Returns 0 if there is none, and
+   -1 if a key is pressed first: a pattern without a literal to look for
+   takes a while over a big file.  As for editor_find(), the part of a
+   mapped file not split into lines yet is searched as it is. */
+static int editor_find_regex(struct regex *re, int dir, struct point *at, int *len) {
+    struct mapping *map = &E.buffer.map;
+    struct point found;
+    int row = at->row;
+    if (dir > 0) {
+        for (int j = row; j < E.buffer.numlines; j++) {
+            if (editor_match_line(re, j, j == row ? at->col : 0, 1, &found, len)) goto done;
+            if ((j & 4095) == 4095 && term_pending(STDIN_FILENO)) return -1;
+        }
+        size_t off = map->indexed;
+        while (off < map->len) {
+            size_t n = map->len-off;
+            const char *nl;
+            if (n > KILO_REGEX_CHUNK && (nl = memchr(map->data+off+KILO_REGEX_CHUNK, '\n', n-KILO_REGEX_CHUNK)))
+                n = nl+1-(map->data+off);
+            const char *p = regex_find_line(re, map->data+off, n);
+            if (!p) {
+                off += n;
+            } else {
+                while (map->indexed <= (size_t)(p-map->data)) buffer_index_lines(E.buffer.numlines);
+                if (editor_match_line(re, E.buffer.numlines-1, 0, 1, &found, len)) goto done;
+                off = map->indexed;
+            }
+            if (term_pending(STDIN_FILENO)) return -1;
+        }
+        for (int j = 0; j <= row && j < E.buffer.numlines; j++) {
+            if (editor_match_line(re, j, 0, 1, &found, len)) goto done;
+            if ((j & 4095) == 4095 && term_pending(STDIN_FILENO)) return -1;
+        }
+    } else {
+        for (int j = row; j >= 0; j--) {
+            if (j < E.buffer.numlines &&
+                editor_match_line(re, j, j == row ? (size_t)at->col : SIZE_MAX, -1, &found, len)) goto done;
+            if ((j & 4095) == 4095 && term_pending(STDIN_FILENO)) return -1;
+        }
+        buffer_index_lines(INT_MAX);
+        for (int j = E.buffer.numlines-1; j >= row; j--) {
+            if (editor_match_line(re, j, SIZE_MAX, -1, &found, len)) goto done;
+            if ((j & 4095) == 4095 && term_pending(STDIN_FILENO)) return -1;
+        }
+    }
+    return 0;
+done:
+    *at = found;
+    return 1;
+}
+
+/* Regex search: type a pattern and Enter to go to its next match, then
+   C-f/C-n and C-b/C-p for the next and previous ones, Enter to stay there
+   and ESC to go back.  Editing the pattern takes another Enter. */
+static void editorFindRegex(void) {
+    char query[KILO_QUERY_LEN+1] = {0};
+    int qlen = 0;
+    struct regex *re = NULL;
+    const char *status = "(Use ESC/Enter)";
+
+    /* save-excursion */
+    struct point saved_point = E.buffer.point, saved_offset = E.buffer.offset;
+    struct point at = {saved_offset.row+saved_point.row, saved_offset.col+saved_point.col};
+
+    buffer_compact_lines();
+    while(1) {
+        editor_message("Regex: %s %s", query, status);
+        editor_refresh();
+
+        int c = term_read(STDIN_FILENO), dir = 0;
+        if (c == NOTIFY) {
+            buffer_write_done();
+        } else if (c == CTRL_H || c == DEL) {
+            if (qlen != 0) query[--qlen] = '\0';
+            regex_free(re);
+            re = NULL;
+            status = "(Use ESC/Enter)";
+        } else if (c == ESC || (c == CTRL_M && re)) {
+            if (c == ESC) {
+                E.buffer.point = saved_point;
+                E.buffer.offset = saved_offset;
+            }
+            regex_free(re);
+            E.match.len = 0;
+            editor_message("");
+            return;
+        } else if (c == CTRL_M) {
+            const char *err;
+            if (!(re = regex_compile(query, &err))) {
+                status = err;
+                continue;
+            }
+            dir = 1;
+        } else if (re && (c == CTRL_F || c == CTRL_N)) {
+            at.col++;
+            dir = 1;
+        } else if (re && (c == CTRL_B || c == CTRL_P)) {
+            dir = -1;
+        } else if (c < 256 && isprint(c) && qlen < KILO_QUERY_LEN) {
+            query[qlen++] = c;
+            query[qlen] = '\0';
+            regex_free(re);
+            re = NULL;
+            status = "(Use ESC/Enter)";
+        }
+        if (!dir) continue;
+
+        int len, found = editor_find_regex(re, dir, &at, &len);
+        status = found > 0 ? "(Use ESC/Arrows/Enter)" : found < 0 ? "(interrupted)" : "(not found)";
+        E.match.len = 0;
+        if (found > 0) {
+            E.match.row = at.row;
+            E.match.col = at.col;
+            E.match.len = len;
+            editor_point_set(at.row, at.col);
+        }
+    }
+}
 
 /* ========================== Editing Commands ========================= */
 
@@ -246,15 +1025,11 @@ void editorRowDelChar(struct line *line, int at) {
 void editorInsertChar(int c) {
     int filerow = E.buffer.offset.row+E.buffer.point.row;
     int filecol = E.buffer.offset.col+E.buffer.point.col;
-    struct line *row = (filerow >= E.buffer.numlines) ? NULL : &E.buffer.lines[filerow];
 
     /* If point on "line" that does not exist in our represented file, add empty rows */
-    if (!row) {
-        while(E.buffer.numlines <= filerow)
-            buffer_insert_line(E.buffer.numlines,"",0);
-    }
-    row = &E.buffer.lines[filerow];
-    editorRowInsertChar(row,filecol,c);
+    while(!buffer_line(filerow))
+        buffer_insert_line(E.buffer.numlines,"",0);
+    editorRowInsertChar(filerow,filecol,c);
     if (E.buffer.point.row == E.terminal.winsize.col-1)
         E.buffer.offset.col++;
     else
@@ -262,11 +1037,119 @@ void editorInsertChar(int c) {
     E.buffer.dirty++;
 }
 
+/* Put point at <filerow>,<filecol>, scrolling only as far as needed to show it */
+static void editor_point_set(int filerow, int filecol) {
+    int rows = E.terminal.winsize.row, cols = E.terminal.winsize.col;
+    if (filerow < E.buffer.offset.row) E.buffer.offset.row = filerow;
+    else if (filerow >= E.buffer.offset.row+rows) E.buffer.offset.row = filerow-rows+1;
+    if (filecol < E.buffer.offset.col) E.buffer.offset.col = filecol;
+    else if (filecol >= E.buffer.offset.col+cols) E.buffer.offset.col = filecol-cols+1;
+    E.buffer.point.row = filerow-E.buffer.offset.row;
+    E.buffer.point.col = filecol-E.buffer.offset.col;
+}
+
+/* End of the line of text starting at <p>, ie. the next \n or \r */
+static const char *editor_eol(const char *p, const char *end) {
+    while (p < end && *p != '\n' && *p != '\r') p++;
+    return p;
+}
+
+/* Insert <len> chars of text at <filerow>,<filecol> as one edit: \n, \r
+   and \r\n all break lines.  Each line is copied and rendered once.
+   Returns where the text ends. */
+static struct point buffer_insert_text(int filerow, int filecol, const char *s, size_t len) {
+    const char *end = s+len, *eol = editor_eol(s,end);
+
+    while(!buffer_line(filerow))
+        buffer_insert_line(E.buffer.numlines,"",0);
+    struct line *row = buffer_line(filerow);
+    if (filecol > row->size) filecol = row->size;
+
+    /* text without line breaks goes into a chunked line as it is */
+    if (eol == end && row->chunks) {
+        buffer_splice_line(filerow,filecol,0,s,len);
+        undo_record(UNDO_INSERT,filerow,filecol,s,len);
+        return (struct point){filerow,filecol+len};
+    }
+    row = buffer_edit_line(filerow);
+
+    /* logged as one record, with every line break a \n: never longer */
+    char *text = undo_begin(UNDO_INSERT,filerow,filecol,len);
+    size_t textlen = 0;
+    undo.off++;
+
+    /* the rest of the line goes after the text */
+    size_t taillen = row->size-filecol;
+    char *tail = malloc(taillen+1);
+    memcpy(tail,row->chars+filecol,taillen);
+    row->size = filecol;
+    row->chars[filecol] = '\0';
+
+    struct point at = {filerow,0};
+    editorRowAppendString(filerow,(char *)s,eol-s);
+    if (text) memcpy(text,s,eol-s), textlen = eol-s;
+    while (eol < end) {
+        s = eol + ((eol[0] == '\r' && eol+1 < end && eol[1] == '\n') ? 2 : 1);
+        eol = editor_eol(s,end);
+        buffer_insert_line(++at.row,(char *)s,eol-s);
+        if (text) {
+            text[textlen++] = '\n';
+            memcpy(text+textlen,s,eol-s);
+            textlen += eol-s;
+        }
+    }
+    at.col = buffer_line(at.row)->size;
+    editorRowAppendString(at.row,tail,taillen);
+    free(tail);
+
+    undo.off--;
+    if (text) undo_end(textlen);
+    return at;
+}
+
+/* Delete <len> chars of text known to be at <filerow>,<filecol>, the
+   inverse of buffer_insert_text(): each \n in it joins two lines */
+static void buffer_delete_text(int filerow, int filecol, const char *s, size_t len) {
+    int nl = search_count(s,len,'\n');
+    undo_record(UNDO_DELETE,filerow,filecol,s,len);
+    undo.off++;
+    if (nl == 0 && buffer_line(filerow)->chunks) {
+        buffer_splice_line(filerow,filecol,len,NULL,0);
+    } else if (nl == 0) {
+        struct line *row = buffer_edit_line(filerow);
+        memmove(row->chars+filecol,row->chars+filecol+len,row->size-filecol-len+1);
+        row->size -= len;
+        buffer_render_line(filerow);
+        buffer_modified(filerow);
+    } else {
+        /* what follows the text on its last line moves up to the first */
+        size_t last = len;
+        while (s[last-1] != '\n') last--;
+        struct line *endrow = buffer_flat_line(filerow+nl);
+        char *tail = endrow->chars+(len-last);
+        size_t taillen = endrow->size-(len-last);
+        struct line *row = buffer_edit_line(filerow);
+        row->size = filecol;
+        row->chars[filecol] = '\0';
+        editorRowAppendString(filerow,tail,taillen);
+        for (int i = 0; i < nl; i++) buffer_kill_line(filerow+1);
+    }
+    undo.off--;
+}
+
+/* Insert text at point, eg. a paste */
+void editorInsertText(const char *s, size_t len) {
+    int filerow = E.buffer.offset.row+E.buffer.point.row;
+    int filecol = E.buffer.offset.col+E.buffer.point.col;
+    struct point at = buffer_insert_text(filerow,filecol,s,len);
+    editor_point_set(at.row,at.col);
+}
+
 /* handle inserting newline in middle of line, splitting line */
 void editorInsertNewline(void) {
     int filerow = E.buffer.offset.row+E.buffer.point.row;
     int filecol = E.buffer.offset.col+E.buffer.point.col;
-    struct line *row = (filerow >= E.buffer.numlines) ? NULL : &E.buffer.lines[filerow];
+    struct line *row = buffer_line(filerow);
 
     if (!row) {
         if (filerow == E.buffer.numlines) {
@@ -282,11 +1165,7 @@ void editorInsertNewline(void) {
         buffer_insert_line(filerow,"",0);
     } else {
         /* We are in the middle of a line. Split it between two rows. */
-        buffer_insert_line(filerow+1,row->chars+filecol,row->size-filecol);
-        row = &E.buffer.lines[filerow];
-        row->chars[filecol] = '\0';
-        row->size = filecol;
-        buffer_render_line(row);
+        buffer_insert_text(filerow,filecol,"\n",1);
     }
 fixcursor:
     if (E.buffer.point.row == E.terminal.winsize.row-1) {
@@ -301,7 +1180,7 @@ fixcursor:
 static void editor_point_fix(void) {
     int filerow = E.buffer.offset.row+E.buffer.point.row;
     int filecol = E.buffer.offset.col+E.buffer.point.col;
-    struct line *row = (filerow >= E.buffer.numlines) ? NULL : E.buffer.lines+filerow;
+    struct line *row = buffer_line(filerow);
     int rowlen = row ? row->size : 0;
     if (filecol > rowlen) {
         E.buffer.point.col -= filecol-rowlen;
@@ -311,9 +1190,14 @@ static void editor_point_fix(void) {
         }
     }
 }
+static void editor_point_screen_row(int d);
 static void editor_point_next_line(void) {
     int filerow = E.buffer.offset.row+E.buffer.point.row;
-    if (filerow < E.buffer.numlines) {
+    if (E.buffer.lines.wrap) {
+        editor_point_screen_row(1);
+        return;
+    }
+    if (buffer_line(filerow)) {
       if (E.buffer.point.row == E.terminal.winsize.row-1) {
 	E.buffer.offset.row++;
       } else {
@@ -330,7 +1214,7 @@ static void editor_point_backward_char(void) {
       } else {
 	if (filerow > 0) {
 	  E.buffer.point.row--;
-	  E.buffer.point.col = E.buffer.lines[filerow-1].size;
+	  E.buffer.point.col = buffer_line(filerow-1)->size;
 	  if (E.buffer.point.col > E.terminal.winsize.col-1) {
 	    E.buffer.offset.col = E.buffer.point.col-E.terminal.winsize.col+1;
 	    E.buffer.point.col = E.terminal.winsize.col-1;
@@ -345,7 +1229,7 @@ static void editor_point_backward_char(void) {
 static void editor_point_forward_char(void) {
     int filerow = E.buffer.offset.row+E.buffer.point.row;
     int filecol = E.buffer.offset.col+E.buffer.point.col;
-    struct line *row = (filerow >= E.buffer.numlines) ? NULL : &E.buffer.lines[filerow];
+    struct line *row = buffer_line(filerow);
     if (row && filecol < row->size) {
       if (E.buffer.point.col == E.terminal.winsize.col-1) {
 	E.buffer.offset.col++;
@@ -364,6 +1248,10 @@ static void editor_point_forward_char(void) {
     editor_point_fix();
 }
 static void editor_point_prev_line(void) {
+    if (E.buffer.lines.wrap) {
+        editor_point_screen_row(-1);
+        return;
+    }
     if (E.buffer.point.row == 0) {
       if (E.buffer.offset.row) E.buffer.offset.row--;
     } else {
@@ -371,17 +1259,74 @@ static void editor_point_prev_line(void) {
     }
     editor_point_fix();
 }
+
+/* ============================ Soft wrap ============================
+ *
+ * Lines wider than the window go on over as many screen rows as they
+ * take rather than the window scrolling sideways to them.  The rope counts
+ * the rows of its lines (see rope.c), from their widths in line->rsize,
+ * so the line at a screen row is found without walking the lines above.
+ * Lines are measured as they are indexed or rendered, and all at once
+ * when wrapping is turned on.  E.buffer.wrap_top is the screen row at the
+ * top of the window.  editor_refresh() scrolls it to show point, and
+ * counts the rows again when the window width changed.
+ */
+
+/* Wrap at the window width: measure the lines not measured yet and count
+   the rows of all of them afresh */
+static void buffer_wrap_lines(void) {
+    for (int j = 0, n; j < E.buffer.numlines; j += n) {
+        struct line *line = rope_span(&E.buffer.lines,j,&n);
+        int k = 0;
+        while (k < n && line[k].rsize >= 0) k++;
+        if (k == n) continue;
+        line = rope_get_mut(&E.buffer.lines,j);
+        for (; k < n; k++) line[k].rsize = buffer_line_width(line+k);
+    }
+    rope_wrap(&E.buffer.lines,0);
+    rope_wrap(&E.buffer.lines,E.terminal.winsize.col);
+}
+
+/* Move point <d> screen rows down (up if < 0), to the column under it */
+static void editor_point_screen_row(int d) {
+    int filerow = E.buffer.offset.row+E.buffer.point.row;
+    int filecol = E.buffer.offset.col+E.buffer.point.col;
+    int cols = E.buffer.lines.wrap;
+    struct line *line = buffer_line(filerow);
+    if (!line && d > 0) return;
+    int rcol = line ? editorRenderCol(line,filecol) : 0;
+    int row = rope_row(&E.buffer.lines,filerow) + rcol/cols + d;
+    if (row < 0) row = 0;
+    int at = rope_row_line(&E.buffer.lines,&row);
+    line = buffer_line(at);
+    if (!line && at > E.buffer.numlines) at = E.buffer.numlines;
+    editor_point_set(at, line ? editorColAt(line,row*cols + rcol%cols) : 0);
+}
+
+/* Soft wrap on or off */
+static void editor_wrap_toggle(void) {
+    int filerow = E.buffer.offset.row+E.buffer.point.row;
+    int filecol = E.buffer.offset.col+E.buffer.point.col;
+    if (E.buffer.lines.wrap) {
+        rope_wrap(&E.buffer.lines,0);
+        editor_point_set(filerow,filecol);
+        editor_message("Soft wrap off");
+        return;
+    }
+    buffer_wrap_lines();
+    E.buffer.wrap_top = rope_row(&E.buffer.lines,E.buffer.offset.row);
+    editor_message("Soft wrap on");
+}
 static void editorDelChar(void) {
     int filerow = E.buffer.offset.row+E.buffer.point.row;
     int filecol = E.buffer.offset.col+E.buffer.point.col;
-    struct line *row = (filerow >= E.buffer.numlines) ? NULL : &E.buffer.lines[filerow];
+    struct line *row = buffer_line(filerow);
 
     if (!row || (filecol == 0 && filerow == 0)) return;
     if (filecol == 0) {
         /* col 0, move current line on the right of the previous one. */
-        filecol = E.buffer.lines[filerow-1].size;
-        editorRowAppendString(&E.buffer.lines[filerow-1],row->chars,row->size);
-        buffer_kill_line(filerow);
+        filecol = buffer_line(filerow-1)->size;
+        buffer_delete_text(filerow-1,filecol,"\n",1);
         row = NULL;
         if (E.buffer.point.row == 0)
             E.buffer.offset.row--;
@@ -394,13 +1339,13 @@ static void editorDelChar(void) {
             E.buffer.offset.col += shift;
         }
     } else {
-        editorRowDelChar(row,filecol-1);
+        editorRowDelChar(filerow,filecol-1);
         if (E.buffer.point.col == 0 && E.buffer.offset.col)
             E.buffer.offset.col--;
         else
             E.buffer.point.col--;
     }
-    if (row) buffer_render_line(row);
+    if (row) buffer_render_line(filerow);
     E.buffer.dirty++;
 }
 static void editorDelForwardChar(void) {
@@ -408,65 +1353,641 @@ static void editorDelForwardChar(void) {
   editorDelChar();
 }
 
-/* void editor_page_up(void){ */
-    /* case PAGE_UP: */
-    /* case PAGE_DOWN: */
-    /*     if (c == PAGE_UP && E.buffer.point.row != 0) */
-    /*         E.buffer.point.row = 0; */
-    /*     else if (c == PAGE_DOWN && E.buffer.point.row != E.terminal.winsize.row-1) */
-    /*         E.buffer.point.row = E.terminal.winsize.row-1; */
-    /*     { */
-    /*     int times = E.terminal.winsize.row; */
-    /*     while(times--) */
-    /* 	    eventHandler[c == PAGE_UP ? CTRL_P: CTRL_N](); */
-    /*     } */
-    /*     break; */
-    /*   }; */
-/* } */
+/* ============================ Undo ============================== */
+
+/* Insert the \n-separated lines of <s> as lines <at> on */
+static void undo_insert_lines(int at, const char *s, size_t len) {
+    const char *end = s+len;
+    for (;;) {
+        const char *nl = memchr(s,'\n',end-s);
+        buffer_insert_line(at++,(char *)s,(nl ? nl : end)-s);
+        if (!nl) break;
+        s = nl+1;
+    }
+}
+
+/* Apply a record again, or its inverse when undoing; returns where point goes */
+static struct point undo_apply(struct undo_rec *rec, const char *text, int inverse) {
+    struct point at = {rec->row,rec->col};
+    int type = rec->type;
+    if (inverse) type = type == UNDO_INSERT ? UNDO_DELETE :
+                        type == UNDO_DELETE ? UNDO_INSERT :
+                        type == UNDO_INSERT_LINES ? UNDO_DELETE_LINES : UNDO_INSERT_LINES;
+    switch (type) {
+    case UNDO_INSERT:
+        at = buffer_insert_text(rec->row,rec->col,text,rec->len);
+        if (inverse) at.row = rec->row, at.col = rec->col;
+        break;
+    case UNDO_DELETE:
+        buffer_delete_text(rec->row,rec->col,text,rec->len);
+        break;
+    case UNDO_INSERT_LINES:
+        undo_insert_lines(rec->row,text,rec->len);
+        break;
+    case UNDO_DELETE_LINES:
+        for (int i = 0; i <= rec->nl; i++) buffer_kill_line(rec->row);
+        break;
+    }
+    return at;
+}
+
+/* Take back the last command's edits */
+static void editor_undo(void) {
+    struct undo_rec rec;
+    struct point at;
+    if (!undo.top) {
+        editor_message("Nothing to undo");
+        return;
+    }
+    size_t start = undo_before(undo.top,&rec);
+    int seq = rec.seq;
+    undo.off++;
+    do {
+        at = undo_apply(&rec,undo.data+start+sizeof(rec),1);
+        undo.top = start;
+    } while (undo.top && (start = undo_before(undo.top,&rec), rec.seq == seq));
+    undo.off--;
+    editor_point_set(at.row,at.col);
+}
+
+/* Make the edits of the last command undone again */
+static void editor_redo(void) {
+    struct undo_rec rec;
+    struct point at;
+    if (undo.top == undo.len) {
+        editor_message("Nothing to redo");
+        return;
+    }
+    size_t end = undo_after(undo.top,&rec);
+    int seq = rec.seq;
+    undo.off++;
+    do {
+        at = undo_apply(&rec,undo.data+undo.top+sizeof(rec),0);
+        undo.top = end;
+    } while (undo.top < undo.len && (end = undo_after(undo.top,&rec), rec.seq == seq));
+    undo.off--;
+    editor_point_set(at.row,at.col);
+}
+
+/* ============================= Jumps =============================
+ *
+ * Paging and going to a line or byte offset set point and the top of the
+ * window straight from the line wanted, found in the rope, rather than a
+ * line at a time: a jump anywhere costs one frame.
+ */
+
+/* Read a line of input after <prompt> into query[KILO_QUERY_LEN+1], in the
+   echo area.  Returns 0 if given up with ESC. */
+static int editor_prompt(const char *prompt, char *query) {
+    int qlen = strlen(query);
+    while(1) {
+        editor_message("%s: %s (Use ESC/Enter)", prompt, query);
+        editor_refresh();
+
+        int c = term_read(STDIN_FILENO);
+        if (c == NOTIFY) {
+            buffer_write_done();
+        } else if (c == CTRL_H || c == DEL) {
+            if (qlen != 0) query[--qlen] = '\0';
+        } else if (c == ESC) {
+            editor_message("");
+            return 0;
+        } else if (c == CTRL_M) {
+            editor_message("");
+            return 1;
+        } else if (c < 256 && isprint(c) && qlen < KILO_QUERY_LEN) {
+            query[qlen++] = c;
+            query[qlen] = '\0';
+        }
+    }
+}
+
+/* Point to <filerow>,<filecol>, kept inside the buffer.  The window only
+   moves if that is off it, and then to have it in the middle. */
+static void editor_goto(int filerow, int filecol) {
+    int rows = E.terminal.winsize.row, wrap = E.buffer.lines.wrap;
+    struct line *line = buffer_line(filerow);   /* splits a mapped file that far */
+    if (!line) {
+        filerow = E.buffer.numlines ? E.buffer.numlines-1 : 0;
+        filecol = INT_MAX;
+        line = buffer_line(filerow);
+    }
+    if (filecol > (line ? line->size : 0)) filecol = line ? line->size : 0;
+
+    if (wrap) {
+        int y = rope_row(&E.buffer.lines,filerow) + (line ? editorRenderCol(line,filecol)/wrap : 0);
+        if (y < E.buffer.wrap_top || y >= E.buffer.wrap_top+rows)
+            E.buffer.wrap_top = y > rows/2 ? y-rows/2 : 0;
+    } else if (filerow < E.buffer.offset.row || filerow >= E.buffer.offset.row+rows) {
+        E.buffer.offset.row = filerow > rows/2 ? filerow-rows/2 : 0;
+    }
+    editor_point_set(filerow,filecol);
+}
+
+/* A windowful down (<d> = 1) or up (-1), point staying on its screen row */
+static void editor_page(int d) {
+    int rows = E.terminal.winsize.row;
+    int filerow = E.buffer.offset.row+E.buffer.point.row;
+    int filecol = E.buffer.offset.col+E.buffer.point.col;
+    if (E.buffer.lines.wrap) {
+        E.buffer.wrap_top += d*rows;
+        if (E.buffer.wrap_top < 0) E.buffer.wrap_top = 0;
+        editor_point_screen_row(d*rows);
+        return;
+    }
+    filerow += d*rows;
+    if (filerow < 0) filerow = 0;
+    if (!buffer_line(filerow) && filerow > E.buffer.numlines) filerow = E.buffer.numlines;
+    E.buffer.offset.row += d*rows;
+    if (E.buffer.offset.row > filerow) E.buffer.offset.row = filerow;
+    if (E.buffer.offset.row < 0) E.buffer.offset.row = 0;
+    editor_point_set(filerow,filecol);
+    editor_point_fix();
+}
+
+/* Ask for a line, or line:column, counting from 1 and go there */
+static void editor_goto_line(void) {
+    char query[KILO_QUERY_LEN+1] = {0};
+    if (!editor_prompt("Goto line",query)) return;
+    char *end;
+    long row = strtol(query,&end,10), col = 1;
+    if (*end == ':') col = strtol(end+1,&end,10);
+    if (end == query || *end || row < 1 || col < 1) {
+        editor_message("Not a line number: %s", query);
+        return;
+    }
+    editor_goto(row > INT_MAX ? INT_MAX : row-1, col > INT_MAX ? INT_MAX : col-1);
+}
+
+/* Ask for a byte offset in the text, counting from 0, and go there */
+static void editor_goto_offset(void) {
+    char query[KILO_QUERY_LEN+1] = {0};
+    if (!editor_prompt("Goto byte offset",query)) return;
+    char *end;
+    unsigned long long off = strtoull(query,&end,10);
+    if (end == query || *end || query[0] == '-') {
+        editor_message("Not a byte offset: %s", query);
+        return;
+    }
+
+    /* past the lines split so far, a mapped file is as on disk: split it
+       up to the line holding <off> */
+    struct mapping *map = &E.buffer.map;
+    size_t split = rope_offset(&E.buffer.lines,E.buffer.numlines);
+    if (off >= split && map->indexed < map->len) {
+        size_t n = map->len-map->indexed;
+        if (off-split < n) n = off-split+1;
+        buffer_line(E.buffer.numlines+search_count(map->data+map->indexed,n,'\n'));
+    }
+
+    size_t col = off;
+    int at = rope_offset_line(&E.buffer.lines,&col);
+    editor_goto(at, at < E.buffer.numlines ? (int)col : INT_MAX);
+}
 
 /* ==================== Buffer Commands ========================== */
 
-static void buffer_write(void) {
+/* Lines are written straight from the buffer this many at a time */
+#define BUFFER_WRITE_BATCH 512
 
-    /* join rows into char* buf */
-    int len = 0;
-    char *buf = NULL;
-    {
-      char *p;
-      int j;
-      /* count bytes */
-      for (j = 0; j < E.buffer.numlines; j++)
-        len += E.buffer.lines[j].size+1; /* for \n */
-      len++; /* for \0 */
-
-      p = buf = malloc(len);
-      for (j = 0; j < E.buffer.numlines; j++) {
-        memcpy(p,E.buffer.lines[j].chars,E.buffer.lines[j].size);
-        p += E.buffer.lines[j].size;
-        *p = '\n';
-        p++;
-      }
-      *p = '\0';
-      --len;      /* exclude \0 */
+/* Saving in place splits at most this much more of a mapped file into lines */
+#define BUFFER_WRITE_INDEX (64UL<<20)
+
+/* writev(2) all of iov[0..n), however many calls it takes */
+static int buffer_writev(int fd, struct iovec *iov, int n) {
+    while (n > 0) {
+        ssize_t done = writev(fd,iov,n);
+        if (done == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (n > 0 && (size_t)done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++, n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return 0;
+}
+
+/* Write lines <from> on of rope <r> to <fd>; returns the number of bytes or -1 */
+static long long buffer_write_lines(int fd, struct rope *r, int from) {
+    struct iovec iov[BUFFER_WRITE_BATCH*2];
+    long long len = 0;
+    int iovcnt = 0;
+    struct line *line;
+    for (int j = from, n; (line = rope_span(r, j, &n)) != NULL; j += n) {
+        for (int k = 0; k < n; k++) {
+            iov[iovcnt].iov_base = line[k].chars;
+            iov[iovcnt++].iov_len = line[k].size;
+            iov[iovcnt].iov_base = "\n";
+            iov[iovcnt++].iov_len = 1;
+            len += line[k].size+1;
+            if (iovcnt == BUFFER_WRITE_BATCH*2) {
+                if (buffer_writev(fd,iov,iovcnt) == -1) return -1;
+                iovcnt = 0;
+            }
+        }
+    }
+    if (buffer_writev(fd,iov,iovcnt) == -1) return -1;
+    return len;
+}
+
+/* Offset in the file on disk of line <at>, all lines before it unchanged
+   since the last save.  Mapped lines know theirs; lines copied out of the
+   mapping unchanged, and lines a save already rewrote in place, are
+   counted on from the last mapped line or from where that save began. */
+static long long buffer_line_offset(int at) {
+    struct mapping *map = &E.buffer.map;
+    long long off = 0;
+    int j = 0;
+    if (at <= map->tail) {
+        buffer_index_lines(at-1);
+        for (j = at; j > 0; j--) {
+            struct line *line = rope_get(&E.buffer.lines, j-1);
+            if (buffer_line_mapped(line)) {
+                off = line->chars - map->data + line->size + 1;
+                break;
+            }
+        }
+    } else {
+        off = map->tail_off;
+        j = map->tail;
     }
+    for (int n; j < at; j += n) {
+        struct line *line = rope_span(&E.buffer.lines, j, &n);
+        if (n > at-j) n = at-j;
+        for (int k = 0; k < n; k++) off += line[k].size+1;
+    }
+    return off;
+}
+
+/* Set up saving a mapped file by rewriting it in place from the first
+   line that changed, when that is less than half of it and the file on
+   disk is still the one mapped.  Returns 1 if set up, 0 if the whole file
+   needs writing, -1 on error.  Not atomic like the temporary file, which
+   is why it is kept to files too large to rewrite on every save. */
+static int buffer_write_tail(void) {
+    struct mapping *map = &E.buffer.map;
+    struct stat st;
+
+    if (!map->data || !map->ondisk || E.buffer.dirty_from == 0) return 0;
+    if (map->len-map->indexed > BUFFER_WRITE_INDEX) return 0;
+    if (stat(E.buffer.filename,&st) == -1 ||
+        (unsigned long long)st.st_dev != map->dev ||
+        (unsigned long long)st.st_ino != map->ino ||
+        (unsigned long long)st.st_size != map->size) return 0;
+
+    buffer_index_lines(INT_MAX);
+    int from = E.buffer.dirty_from < E.buffer.numlines ? E.buffer.dirty_from : E.buffer.numlines;
+    if (from > 0) {
+        /* the last line of the file may have no \n after it on disk: then
+           it goes out again, with one */
+        struct line *line = buffer_line(from-1);
+        const char *end = line->chars+line->size;
+        if (buffer_line_mapped(line) && (end == map->data+map->len || *end != '\n')) from--;
+    }
+    long long off = buffer_line_offset(from), size = off;
+    for (int j = from, n; j < E.buffer.numlines; j += n) {
+        struct line *line = rope_span(&E.buffer.lines, j, &n);
+        for (int k = 0; k < n; k++) size += line[k].size+1;
+    }
+    if (size-off > off) return 0;
 
-    int fd = open(E.buffer.filename,O_RDWR|O_CREAT,0644);
-    if (fd == -1) goto writeerr;
+    int fd = open(E.buffer.filename,O_WRONLY);
+    if (fd == -1) return -1;
+    if (lseek(fd,off,SEEK_SET) == -1) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    /* the mapping sees what is written over it: copy out what it backs */
+    for (int j = from, n; j < E.buffer.numlines; j += n) {
+        struct line *line = rope_span(&E.buffer.lines, j, &n);
+        for (int k = 0; k < n; k++) buffer_own_line(line+k);
+    }
+    /* nothing maps past <off> any more: unmap the pages there, which would
+       fault once the file is truncated below them */
+    size_t page = sysconf(_SC_PAGESIZE), keep = (off+page-1)/page*page;
+    if (keep < map->len) munmap(map->data+keep, map->len-keep);
+    map->len = map->indexed = off;
 
-    /* Use truncate + single write(2) call in order to make saving safer */
-    if (ftruncate(fd,len) == -1) goto writeerr;
-    if (write(fd,buf,len) != len) goto writeerr;
+    save.fd = fd;
+    save.from = from;
+    save.off = off;
+    save.size = size;
+    return 1;
+}
+
+/* Set up saving to a temporary file next to the original, which is
+   renamed over it once written.  0 ⇒ success */
+static int buffer_write_temp(void) {
+    struct stat st;
+    mode_t mode;
+
+    /* a symlink stays one: the file it points to is the one replaced */
+    char *path = realpath(E.buffer.filename,NULL);
+    if (!path) {
+        if (errno != ENOENT) return -1;
+        path = strdup(E.buffer.filename);
+    }
+    size_t namelen = strlen(path);
+    char *tmpname = malloc(namelen+8);
+    memcpy(tmpname,path,namelen);
+    memcpy(tmpname+namelen,".XXXXXX",8);
 
+    int fd = mkstemp(tmpname);
+    if (fd == -1) goto err;
+
+    /* keep the owner and permissions of the file, or make it as open(2)
+       would.  Only root may give a file away: others keep the group if
+       they can, and own the new file. */
+    if (stat(path,&st) == 0) {
+        if (fchown(fd,st.st_uid,st.st_gid) == -1) fchown(fd,-1,st.st_gid);
+        mode = st.st_mode & 07777;
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        mode = 0666 & ~mask;
+    }
+    if (fchmod(fd,mode) == -1) goto err;
+
+    save.fd = fd;
+    save.tmpname = tmpname;
+    save.path = path;
+    save.from = 0;
+    if (E.buffer.map.data) {
+        save.rest = E.buffer.map.data+E.buffer.map.indexed;
+        save.restlen = E.buffer.map.len-E.buffer.map.indexed;
+    }
+    return 0;
+
+err: {
+        int saved_errno = errno;
+        if (fd != -1) {
+            close(fd);
+            unlink(tmpname);
+        }
+        free(tmpname);
+        free(path);
+        errno = saved_errno;
+        return -1;
+    }
+}
+
+/* fsync the directory holding <path>, so that a rename into it lasts */
+static int buffer_write_sync_dir(const char *path) {
+    const char *slash = strrchr(path,'/');
+    char *dir = slash ? strndup(path,slash == path ? 1 : (size_t)(slash-path)) : strdup(".");
+    int fd = open(dir,O_RDONLY);
+    free(dir);
+    if (fd == -1) return -1;
+    int r = fsync(fd);
+    int saved_errno = errno;
     close(fd);
-    free(buf);
-    E.buffer.dirty = 0;
-    editor_message("%d bytes written on disk", len);
-    return;
+    errno = saved_errno;
+    /* some file systems can't sync a directory, and say so */
+    return r == -1 && errno != EINVAL ? -1 : 0;
+}
+
+/* Worker thread: write the snapshot, then put it in place */
+static void *buffer_write_worker(void *unused __attribute__((unused))) {
+    int fd = save.fd, renamed = 0;
+    save.err = 0;
+    if ((save.len = buffer_write_lines(fd,&save.lines,save.from)) == -1) goto writeerr;
+
+    /* the part of a mapped file not split into lines goes out as it is */
+    while (save.restlen) {
+        struct iovec iov = {(char *)save.rest, save.restlen < (1UL<<30) ? save.restlen : (1UL<<30)};
+        if (buffer_writev(fd,&iov,1) == -1) goto writeerr;
+        save.rest += iov.iov_len;
+        save.restlen -= iov.iov_len;
+        save.len += iov.iov_len;
+    }
+
+    if (!save.tmpname && ftruncate(fd,save.size) == -1) goto writeerr;
+    if (fsync(fd) == -1) goto writeerr;
+    fd = -1;
+    if (close(save.fd) == -1) goto writeerr;
+    if (save.tmpname) {
+        if (rename(save.tmpname,save.path) == -1) goto writeerr;
+        renamed = 1;
+        if (buffer_write_sync_dir(save.path) == -1) goto writeerr;
+    }
+    goto done;
 
 writeerr:
-    free(buf);
+    save.err = errno;
     if (fd != -1) close(fd);
-    editor_message("Can't save! I/O error: %s",strerror(errno));
+    if (save.tmpname && !renamed) unlink(save.tmpname);
+done:
+    write(save.notify[1],"",1);
+    return NULL;
+}
+
+/* Reap the save once its worker is done, see term_watch() */
+static void buffer_write_done(void) {
+    char c;
+    if (!save.running) return;
+    if (!pthread_equal(save.thread,pthread_self())) pthread_join(save.thread,NULL);
+    while (read(save.notify[0],&c,1) == 1);
+    save.running = 0;
+
+    rope_free(&save.lines);
+    for (int i = 0; i < save.ngarbage; i++)
+        slab_free(&E.buffer.store,save.garbage[i].chars,save.garbage[i].cap);
+    save.ngarbage = 0;
+
+    struct mapping *map = &E.buffer.map;
+    if (save.err) {
+        if (save.dirty_from < E.buffer.dirty_from) E.buffer.dirty_from = save.dirty_from;
+        if (!save.tmpname) map->ondisk = 0; /* half rewritten */
+        editor_message("Can't save! I/O error: %s",strerror(save.err));
+    } else {
+        E.buffer.dirty -= save.dirty;
+        if (save.tmpname) {
+            map->ondisk = 0; /* lines may have moved in the new file */
+        } else {
+            map->size = save.size;
+            if (save.from < map->tail) {
+                map->tail = save.from;
+                map->tail_off = save.off;
+            }
+        }
+        editor_message("%lld bytes written on disk", save.len);
+    }
+    free(save.tmpname);
+    free(save.path);
+    save.tmpname = save.path = NULL;
+}
+
+/* Block until a save in progress is done */
+static void buffer_write_wait(void) {
+    buffer_write_done();
+}
+
+/* Save in the background: the lines are snapshotted in O(1) (see
+   rope_snapshot()) and a worker thread writes them with writev(2),
+   straight from where they are, while editing goes on.  A file that is
+   not saved in place goes to a temporary file that is fsync'ed and
+   renamed over the original, so the file on disk is always either the
+   old or the new contents. */
+static void buffer_write(void) {
+    if (save.running) {
+        editor_message("Still saving %s", E.buffer.filename);
+        return;
+    }
+    if (!save.notify[1]) {
+        if (pipe(save.notify) == -1) {
+            editor_message("Can't save! %s",strerror(errno));
+            return;
+        }
+        fcntl(save.notify[0], F_SETFL, O_NONBLOCK);
+        term_watch(save.notify[0]);
+    }
+
+    buffer_compact_lines();
+    save.rest = NULL;
+    save.restlen = 0;
+    save.tmpname = save.path = NULL;
+    int r = buffer_write_tail();
+    if (r == 0) r = buffer_write_temp();
+    if (r == -1) {
+        editor_message("Can't save! I/O error: %s",strerror(errno));
+        return;
+    }
+
+    rope_snapshot(&E.buffer.lines, &save.lines);
+    save.dirty = E.buffer.dirty;
+    save.dirty_from = E.buffer.dirty_from;
+    E.buffer.dirty_from = INT_MAX;
+    save.running = 1;
+    if (pthread_create(&save.thread,NULL,buffer_write_worker,NULL) != 0) {
+        save.thread = pthread_self(); /* no thread to join: save right here */
+        buffer_write_worker(NULL);
+    }
+    editor_message("Saving %s...", E.buffer.filename);
+}
+
+/* A file being split into the lines of a rope growing a leaf at a time,
+   a block at a time, see buffer_load_file() */
+static struct {
+    int n;              /* lines in the rope */
+    int filled;         /* lines filled so far */
+    struct line *line;  /* next line to fill ... */
+    int left;           /* ... and lines after it in its leaf */
+    char *part;         /* a line that the last block ended in */
+    size_t partlen, partcap;
+} load;
+
+/* Up to <size> bytes of <fd>, short only at the end; -1 on error */
+static ssize_t buffer_read_block(int fd, char *block, size_t size) {
+    size_t got = 0;
+    while (got < size) {
+        ssize_t r = read(fd,block+got,size-got);
+        if (r == 0) break;
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        got += r;
+    }
+    return got;
+}
+
+/* Fill the next line of the rope with s[0..len) */
+static void buffer_load_line(const char *s, size_t len) {
+    if (!load.left) {
+        load.line = rope_append(&E.buffer.lines,&load.left);
+        if (load.n > INT_MAX-load.left) {
+            printf("file has too many lines ... quiting\n");
+            exit(1);
+        }
+        load.n += load.left;
+    }
+    if (len >= INT_MAX) {
+        printf("file lines are too long ... quiting\n");
+        exit(1);
+    }
+    struct line *line = load.line++;
+    load.left--;
+    load.filled++;
+    line->size = len;
+    line->chars = slab_alloc(&E.buffer.store,len+1);
+    line->cap = slab_size(len+1);
+    memcpy(line->chars,s,len);
+    line->chars[len] = '\0';
+    line->hl = NULL;
+    line->hl_ic = line->hl_oc = 0;
+    line->hl_stale = 1;
+    line->pinned = 0;
+    line->render = NULL;    /* rendered when first drawn */
+    line->rsize = -1;
+    line->chunks = NULL;
+}
+
+/* Keep s[0..len) for the line the block ends in */
+static void buffer_load_part(const char *s, size_t len) {
+    if (load.partlen+len > load.partcap) {
+        load.partcap = load.partlen+len > 2*load.partcap ? load.partlen+len : 2*load.partcap;
+        load.part = realloc(load.part,load.partcap);
+    }
+    memcpy(load.part+load.partlen,s,len);
+    load.partlen += len;
+}
+
+/* Cut the lines of s[0..len), the next block of the file, with memchr */
+static void buffer_load_block(const char *s, size_t len) {
+    const char *end = s+len;
+    while (s < end) {
+        const char *nl = memchr(s,'\n',end-s);
+        if (!nl) {
+            buffer_load_part(s,end-s);
+            return;
+        }
+        if (load.partlen) {
+            buffer_load_part(s,nl-s);
+            buffer_load_line(load.part,load.partlen);
+            load.partlen = 0;
+        } else {
+            buffer_load_line(s,nl-s);
+        }
+        s = nl+1;
+    }
+}
+
+/* Read the file open on <fd> into the empty buffer, in one pass through a
+   block of BUFFER_READ_BLOCK bytes: the lines are cut out of each block
+   and copied to the slab, and the rope grows a full leaf at a time to
+   hold them.  Pipes are read the same way. */
+static void buffer_load_file(int fd) {
+    char *block = malloc(BUFFER_READ_BLOCK);
+    ssize_t got;
+
+    memset(&load,0,sizeof(load));
+    while ((got = buffer_read_block(fd,block,BUFFER_READ_BLOCK)) > 0)
+        buffer_load_block(block,got);
+    if (got < 0) {
+        perror("Reading file");
+        exit(1);
+    }
+
+    /* as getline did: a last line without \n loses a \r instead */
+    if (load.partlen) {
+        if (load.part[load.partlen-1] == '\r') load.partlen--;
+        buffer_load_line(load.part,load.partlen);
+    }
+    /* the rest of the last leaf */
+    while (load.n > load.filled) rope_delete(&E.buffer.lines,--load.n);
+    rope_sum(&E.buffer.lines);
+    E.buffer.numlines = load.filled;
+    free(load.part);
+    free(block);
 }
 
 /* 0 ⇒ success */
@@ -489,47 +2010,40 @@ int buffer_find_file(char *filename) {
         return 1;
     }
 
-    char *line = NULL;
-    size_t linecap=0, linelen;
-    while((linelen = getline(&line,&linecap,fp)) != (size_t)-1) {
-        if (linelen && (line[linelen-1] == '\n' || line[linelen-1] == '\r'))
-            line[--linelen] = '\0';
-        buffer_insert_line(E.buffer.numlines,line,linelen);
+    struct stat st;
+    if (fstat(fileno(fp),&st) != 0) st.st_size = 0;
+    if ((size_t)st.st_size >= BUFFER_MMAP_SIZE) {
+        void *data = mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fileno(fp),0);
+        if (data != MAP_FAILED) {
+            E.buffer.map.data = data;
+            E.buffer.map.len = st.st_size;
+            E.buffer.map.indexed = 0;
+            E.buffer.map.dev = st.st_dev;
+            E.buffer.map.ino = st.st_ino;
+            E.buffer.map.size = st.st_size;
+            E.buffer.map.ondisk = 1;
+            E.buffer.map.tail = INT_MAX;
+            fclose(fp);
+            return 0;
+        }
     }
-    free(line);
+
+    buffer_load_file(fileno(fp));
     fclose(fp);
+    if (E.buffer.lines.wrap) buffer_wrap_lines();
     E.buffer.dirty = 0;
+    E.buffer.dirty_from = INT_MAX;
     return 0;
 }
 void buffer_find_file_interactive(void) {
-  int fd = 1;
   if (E.buffer.dirty) {
     editor_message("You must first write or discard the current changes");
     return;
   }
     char query[KILO_QUERY_LEN+1] = {0};
-    int qlen = 0;
-    while(1) {
-        editor_message("File name: %s (Use ESC/Enter)", query);
-        editor_refresh();
-
-        int c = term_read(fd);
-        if (c == CTRL_H || c == DEL) {
-            if (qlen != 0) query[--qlen] = '\0';
-        } else if (c == ESC) {
-            editor_message("");
-	    return;
-	} else if (c == CTRL_M) {
-	    editor_message("Opening %s", query);
-	    buffer_find_file(query);
-            return;
-        } else if (isprint(c)) {
-            if (qlen < KILO_QUERY_LEN) {
-                query[qlen++] = c;
-                query[qlen] = '\0';
-            }
-        }
-    }
+    if (!editor_prompt("File name",query)) return;
+    editor_message("Opening %s", query);
+    buffer_find_file(query);
 }
 
 #define KILO_QUIT_TIMES 2
@@ -537,6 +2051,7 @@ static int quit_times = KILO_QUIT_TIMES;
 
 /* When modified, require C-q ... C-q (KILO_QUIT_TIMES) */
 static void editor_quit(void) {
+  buffer_write_wait();
   if (!E.buffer.dirty || !quit_times) exit(0);
   editor_message(
       "WARNING!!! unsaved changes. Press C-q %d more times to quit.",
@@ -552,18 +2067,36 @@ static void (*eventHandler[256])(void) = {
   [CTRL_B] = editor_point_backward_char,
   [CTRL_D] = editorDelForwardChar,
   [CTRL_L] = buffer_find_file_interactive,
-  /* [CTRL_Y] = editorFind, */
+  [CTRL_Y] = editorFind,
+  [CTRL_R] = editorFindRegex,
   [CTRL_M] = editorInsertNewline,
   [CTRL_H] = editorDelChar,
   [DEL]    = editorDelChar, 
   [CTRL_S] = buffer_write,
   [CTRL_K] = buffer_kill_line_interactive,
   [CTRL_Q] = editor_quit,
+  [CTRL_Z] = editor_undo,
+  [CTRL_T] = editor_redo,
+  [CTRL_W] = editor_wrap_toggle,
+  [CTRL_G] = editor_goto_line,
+  [CTRL_O] = editor_goto_offset,
 };
 
 void editor_process(int c) {
-    if (isprint(c)) editorInsertChar(c);
-    else if (eventHandler[c] != NULL) eventHandler[c]();
+    if (c == RESIZE || c == TIMER) return; /* nothing to do but redraw */
+    if (c == NOTIFY) {
+        buffer_write_done();
+        return;
+    }
+    undo.seq++; /* the edits of one command are undone together */
+    if (c == PASTE) {
+        size_t len;
+        char *text = term_paste(&len);
+        editorInsertText(text,len);
+    }
+    else if (c < 256 && isprint(c)) editorInsertChar(c);
+    else if (c < 256 && eventHandler[c] != NULL) eventHandler[c]();
+    else if (c == PAGE_UP || c == PAGE_DOWN) editor_page(c == PAGE_UP ? -1 : 1);
     else editor_message("unknown command. HELP: C-s: save | C-q: quit | C-f: find");
     if (c != CTRL_Q) quit_times = KILO_QUIT_TIMES; /* reset static var */
 }
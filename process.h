@@ -1,2 +1,6 @@
 void editor_process(int);
 int buffer_find_file(char *);
+struct line *buffer_line(int);
+void buffer_render_line(int);
+int buffer_indexed(void);
+int editor_match_index(int, int);
@@ -0,0 +1,648 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "regex.h"
+#include "search.h"
+
+/* ============================ Regex search ============================
+ *
+ * A pattern is parsed into a tree, and the tree compiled into three
+ * Thompson NFAs: forwards and unanchored, to tell whether a line holds a
+ * match at all; backwards and unanchored, to find where matches start; and
+ * forwards anchored, to find where the longest match from a start ends.
+ * The NFAs are never simulated as such.  Each is turned into a DFA one
+ * state at a time, as the text asks for them, and the states are cached.
+ * Every byte of text then costs a table lookup whatever the pattern, and
+ * no pattern makes matching backtrack.
+ *
+ * Lines are bracketed by two extra symbols, BOL and EOL, which is what ^
+ * and $ match.  Symbols that no set in the pattern tells apart share a
+ * class, so a DFA state only needs a transition per class.
+ *
+ * Syntax: . [] [^] * + ? | () ^ $, \d \w \s and their negations \D \W
+ * \S, \t, and \ to quote any other char.
+ */
+
+#define RE_BOL 256
+#define RE_EOL 257
+#define RE_SYMBOLS 258
+/* DFA states cached per NFA before the cache is dropped and refilled */
+#define RE_STATES 2048
+
+struct re_set {
+    unsigned char bits[(RE_SYMBOLS+7)/8];
+};
+
+enum { RE_LIT, RE_CAT, RE_ALT, RE_STAR, RE_PLUS, RE_QUEST, RE_EMPTY };
+struct re_node {
+    int type;
+    int a, b;           /* kids; RE_LIT: a is the set */
+};
+
+enum { NFA_SET, NFA_SPLIT, NFA_MATCH };
+struct nfa_state {
+    int type;
+    int out, out1;      /* NFA_SPLIT: both, -1 for none; NFA_SET: out1 is the set */
+};
+
+struct dfa_state {
+    int *set;           /* NFA_SET and NFA_MATCH states, sorted */
+    int n;
+    unsigned hash;
+};
+
+/* Flags of a DFA state, kept in the last column of its row */
+#define DFA_ACCEPT 1    /* holds NFA_MATCH */
+#define DFA_DEAD 2      /* holds nothing: no match can follow */
+
+struct dfa {
+    struct nfa_state *nfa;
+    int nnfa, nfacap;
+    int start;          /* NFA state to start from */
+    struct dfa_state *states;
+    int nstates;
+    /* A row of <stride> ints per state: the row of the state after each
+       class, -1 until needed, then the flags.  States go by their row. */
+    int *trans;
+    int stride;
+    int table[RE_STATES*2]; /* hash of sets to states, -1 for free */
+    int init;           /* row of the state to start from, -1 until needed */
+    int *stack, *mark, *buf; /* closure scratch, one per NFA state */
+    int gen;
+};
+
+struct regex {
+    struct re_set *sets;
+    int nsets, setcap;
+    struct re_node *nodes;
+    int nnodes, nodecap;
+    int root;
+    unsigned short cls[RE_SYMBOLS]; /* class of each symbol */
+    int rep[RE_SYMBOLS];    /* a symbol of each class */
+    int nclasses;
+    char *literal;      /* every match holds these chars, see re__literal() */
+    size_t literal_len;
+    struct dfa find, back, forward;
+    const char *p;      /* parser position */
+    const char *err;
+};
+
+/* ============================ Parser ============================ */
+
+static void set_add(struct re_set *set, int c) {
+    set->bits[c>>3] |= 1<<(c&7);
+}
+
+static int set_has(struct re_set *set, int c) {
+    return set->bits[c>>3] & (1<<(c&7));
+}
+
+static int re__set(struct regex *re) {
+    if (re->nsets == re->setcap) {
+        re->setcap = re->setcap ? re->setcap*2 : 16;
+        re->sets = realloc(re->sets, sizeof(struct re_set)*re->setcap);
+    }
+    memset(re->sets+re->nsets, 0, sizeof(struct re_set));
+    return re->nsets++;
+}
+
+static int re__node(struct regex *re, int type, int a, int b) {
+    if (re->nnodes == re->nodecap) {
+        re->nodecap = re->nodecap ? re->nodecap*2 : 32;
+        re->nodes = realloc(re->nodes, sizeof(struct re_node)*re->nodecap);
+    }
+    re->nodes[re->nnodes] = (struct re_node){type, a, b};
+    return re->nnodes++;
+}
+
+static int re__class_char(int c, int k) {
+    switch (k) {
+    case 'd': return c >= '0' && c <= '9';
+    case 'w': return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+    case 's': return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+    return 0;
+}
+
+/* Add what \<k> stands for to <set> */
+static void re__escape(struct re_set *set, int k) {
+    int lower = k | 0x20;
+    if (lower == 'd' || lower == 'w' || lower == 's') {
+        for (int c = 0; c < 256; c++)
+            if (re__class_char(c, lower) == (k == lower)) set_add(set, c);
+    } else {
+        set_add(set, k == 't' ? '\t' : (unsigned char)k);
+    }
+}
+
+/* [...] after the [ */
+static int re__bracket(struct regex *re) {
+    int s = re__set(re), negate = 0;
+    struct re_set set = {{0}};
+    if (*re->p == '^') {
+        negate = 1;
+        re->p++;
+    }
+    for (int first = 1; first || *re->p != ']'; first = 0) {
+        int c = (unsigned char)*re->p++;
+        if (c == '\0') {
+            re->err = "missing ]";
+            return -1;
+        }
+        if (c == '\\') {
+            if (*re->p == '\0') continue;
+            re__escape(&set, (unsigned char)*re->p++);
+            continue;
+        }
+        int hi = c;
+        if (re->p[0] == '-' && re->p[1] != ']' && re->p[1] != '\0') {
+            hi = (unsigned char)re->p[1];
+            re->p += 2;
+        }
+        for (int k = c; k <= hi; k++) set_add(&set, k);
+    }
+    re->p++;
+    for (int c = 0; c < 256; c++)
+        if ((set_has(&set, c) != 0) != negate) set_add(re->sets+s, c);
+    return re__node(re, RE_LIT, s, 0);
+}
+
+static int re__alt(struct regex *re);
+
+static int re__atom(struct regex *re) {
+    int c = (unsigned char)*re->p++, s;
+    switch (c) {
+    case '(': {
+        int n = re__alt(re);
+        if (n < 0) return -1;
+        if (*re->p != ')') {
+            re->err = "missing )";
+            return -1;
+        }
+        re->p++;
+        return n;
+    }
+    case '[':
+        return re__bracket(re);
+    case '*': case '+': case '?':
+        re->err = "nothing to repeat";
+        return -1;
+    }
+    s = re__set(re);
+    if (c == '.') {
+        for (int k = 0; k < 256; k++) set_add(re->sets+s, k);
+    } else if (c == '^') {
+        set_add(re->sets+s, RE_BOL);
+    } else if (c == '$') {
+        set_add(re->sets+s, RE_EOL);
+    } else if (c == '\\') {
+        if (*re->p == '\0') {
+            re->err = "trailing \\";
+            return -1;
+        }
+        re__escape(re->sets+s, (unsigned char)*re->p++);
+    } else {
+        set_add(re->sets+s, c);
+    }
+    return re__node(re, RE_LIT, s, 0);
+}
+
+static int re__repeat(struct regex *re) {
+    int n = re__atom(re);
+    for (; n >= 0; re->p++) {
+        if (*re->p == '*') n = re__node(re, RE_STAR, n, 0);
+        else if (*re->p == '+') n = re__node(re, RE_PLUS, n, 0);
+        else if (*re->p == '?') n = re__node(re, RE_QUEST, n, 0);
+        else break;
+    }
+    return n;
+}
+
+static int re__cat(struct regex *re) {
+    int n = re__node(re, RE_EMPTY, 0, 0);
+    while (*re->p != '\0' && *re->p != '|' && *re->p != ')') {
+        int m = re__repeat(re);
+        if (m < 0) return -1;
+        n = re->nodes[n].type == RE_EMPTY ? m : re__node(re, RE_CAT, n, m);
+    }
+    return n;
+}
+
+static int re__alt(struct regex *re) {
+    int n = re__cat(re);
+    while (n >= 0 && *re->p == '|') {
+        re->p++;
+        int m = re__cat(re);
+        n = m < 0 ? -1 : re__node(re, RE_ALT, n, m);
+    }
+    return n;
+}
+
+/* Split the symbols into classes no set tells apart; \n gets its own,
+   for regex_find_line() to spot */
+static void re__classes(struct regex *re) {
+    int split[RE_SYMBOLS*2];
+    memset(re->cls, 0, sizeof(re->cls));
+    re->nclasses = 1;
+    for (int s = -1; s < re->nsets; s++) {
+        int n = 0;
+        for (int k = 0; k < re->nclasses*2; k++) split[k] = -1;
+        for (int c = 0; c < RE_SYMBOLS; c++) {
+            int in = s < 0 ? c == '\n' : set_has(re->sets+s, c) != 0;
+            int *k = &split[re->cls[c]*2+in];
+            if (*k < 0) *k = n++;
+            re->cls[c] = *k;
+        }
+        re->nclasses = n;
+    }
+    for (int c = RE_SYMBOLS-1; c >= 0; c--) re->rep[re->cls[c]] = c;
+}
+
+/* The single byte <node> matches, or -1 */
+static int re__byte(struct regex *re, int node) {
+    if (re->nodes[node].type != RE_LIT) return -1;
+    struct re_set *set = re->sets+re->nodes[node].a;
+    int byte = -1;
+    for (int c = 0; c < RE_SYMBOLS; c++) {
+        if (!set_has(set, c)) continue;
+        if (byte >= 0 || c >= 256) return -1;
+        byte = c;
+    }
+    return byte;
+}
+
+/* Collect the kids of the concatenation at <node> in order */
+static void re__flatten(struct regex *re, int node, int *kids, int *n) {
+    if (re->nodes[node].type == RE_CAT) {
+        re__flatten(re, re->nodes[node].a, kids, n);
+        re__flatten(re, re->nodes[node].b, kids, n);
+    } else {
+        kids[(*n)++] = node;
+    }
+}
+
+/* The longest run of plain chars the pattern is a concatenation of: lines
+   without it can't match, and search_forward() finds it fast */
+static void re__literal(struct regex *re) {
+    int *kids = malloc(sizeof(int)*re->nnodes), n = 0;
+    char *run = malloc(re->nnodes+1);
+    size_t len = 0;
+    re->literal = malloc(re->nnodes+1);
+    re->literal_len = 0;
+    re__flatten(re, re->root, kids, &n);
+    for (int i = 0; i <= n; i++) {
+        int c = i < n ? re__byte(re, kids[i]) : -1, plus = 0;
+        if (c < 0 && i < n && re->nodes[kids[i]].type == RE_PLUS)
+            plus = (c = re__byte(re, re->nodes[kids[i]].a)) >= 0;
+        if (c >= 0) run[len++] = c;
+        if (c < 0 || plus) {
+            /* the run ends here: x+ leaves an x to start the next one */
+            if (len > re->literal_len) {
+                memcpy(re->literal, run, len);
+                re->literal_len = len;
+            }
+            len = 0;
+            if (plus) run[len++] = c;
+        }
+    }
+    free(kids);
+    free(run);
+}
+
+/* ============================ Lazy DFA ============================ */
+
+static int nfa__add(struct dfa *d, int type, int out, int out1) {
+    if (d->nnfa == d->nfacap) {
+        d->nfacap = d->nfacap ? d->nfacap*2 : 64;
+        d->nfa = realloc(d->nfa, sizeof(struct nfa_state)*d->nfacap);
+    }
+    d->nfa[d->nnfa] = (struct nfa_state){type, out, out1};
+    return d->nnfa++;
+}
+
+/* NFA state matching <node> then going on to <next>; backwards if <reverse> */
+static int nfa__compile(struct regex *re, struct dfa *d, int node, int next, int reverse) {
+    struct re_node n = re->nodes[node];
+    int s;
+    switch (n.type) {
+    case RE_LIT:
+        return nfa__add(d, NFA_SET, next, n.a);
+    case RE_CAT:
+        if (reverse) return nfa__compile(re, d, n.b, nfa__compile(re, d, n.a, next, reverse), reverse);
+        return nfa__compile(re, d, n.a, nfa__compile(re, d, n.b, next, reverse), reverse);
+    case RE_ALT:
+        s = nfa__compile(re, d, n.a, next, reverse);
+        return nfa__add(d, NFA_SPLIT, s, nfa__compile(re, d, n.b, next, reverse));
+    case RE_STAR:
+        s = nfa__add(d, NFA_SPLIT, -1, next);
+        d->nfa[s].out = nfa__compile(re, d, n.a, s, reverse);
+        return s;
+    case RE_PLUS:
+        s = nfa__add(d, NFA_SPLIT, -1, next);
+        d->nfa[s].out = nfa__compile(re, d, n.a, s, reverse);
+        return d->nfa[s].out;
+    case RE_QUEST:
+        return nfa__add(d, NFA_SPLIT, nfa__compile(re, d, n.a, next, reverse), next);
+    }
+    return next;
+}
+
+/* Build the NFA of <d>: unanchored ones may skip any symbols first,
+   anchored ones may skip a BOL, which ^ needs but nothing else matches */
+static void dfa__init(struct regex *re, struct dfa *d, int reverse, int unanchored) {
+    int match = nfa__add(d, NFA_MATCH, -1, -1);
+    int entry = nfa__compile(re, d, re->root, match, reverse);
+    int any = re__set(re);
+    if (unanchored) {
+        for (int c = 0; c < RE_SYMBOLS; c++) set_add(re->sets+any, c);
+        d->start = nfa__add(d, NFA_SPLIT, entry, -1);
+        d->nfa[d->start].out1 = nfa__add(d, NFA_SET, d->start, any);
+    } else {
+        set_add(re->sets+any, RE_BOL);
+        d->start = nfa__add(d, NFA_SPLIT, nfa__add(d, NFA_SET, entry, any), entry);
+    }
+    d->stack = malloc(sizeof(int)*d->nnfa);
+    d->mark = calloc(d->nnfa, sizeof(int));
+    d->buf = malloc(sizeof(int)*d->nnfa);
+}
+
+/* Room for the states, once the classes are known */
+static void dfa__alloc(struct regex *re, struct dfa *d) {
+    d->stride = re->nclasses+1;
+    d->states = malloc(sizeof(struct dfa_state)*RE_STATES);
+    d->trans = malloc(sizeof(int)*RE_STATES*d->stride);
+    d->nstates = 0;
+    memset(d->table, -1, sizeof(d->table));
+    d->init = -1;
+}
+
+static void dfa__flush(struct dfa *d) {
+    for (int i = 0; i < d->nstates; i++) free(d->states[i].set);
+    d->nstates = 0;
+    memset(d->table, -1, sizeof(d->table));
+    d->init = -1;
+}
+
+static void dfa__free(struct dfa *d) {
+    if (d->states) dfa__flush(d);
+    free(d->states);
+    free(d->trans);
+    free(d->nfa);
+    free(d->stack);
+    free(d->mark);
+    free(d->buf);
+}
+
+/* Add the states reached from <s> without reading a symbol to d->buf */
+static void dfa__closure(struct dfa *d, int s, int *n) {
+    int top = 0;
+    if (s < 0 || d->mark[s] == d->gen) return;
+    d->mark[s] = d->gen;
+    d->stack[top++] = s;
+    while (top) {
+        struct nfa_state *st = d->nfa+d->stack[--top];
+        if (st->type != NFA_SPLIT) {
+            d->buf[(*n)++] = st-d->nfa;
+            continue;
+        }
+        int outs[2] = {st->out, st->out1};
+        for (int i = 0; i < 2; i++) {
+            if (outs[i] < 0 || d->mark[outs[i]] == d->gen) continue;
+            d->mark[outs[i]] = d->gen;
+            d->stack[top++] = outs[i];
+        }
+    }
+}
+
+static int dfa__cmp(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+/* Row of the DFA state for the NFA states set[0..n), or -1 if the cache is full */
+static int dfa__state(struct regex *re, struct dfa *d, int *set, int n) {
+    unsigned hash = 2166136261u;
+    qsort(set, n, sizeof(int), dfa__cmp);
+    for (int i = 0; i < n; i++) hash = (hash ^ set[i]) * 16777619u;
+
+    unsigned mask = RE_STATES*2-1, h = hash & mask;
+    for (; d->table[h] >= 0; h = (h+1) & mask) {
+        struct dfa_state *st = d->states+d->table[h];
+        if (st->hash == hash && st->n == n && !memcmp(st->set, set, sizeof(int)*n))
+            return d->table[h]*d->stride;
+    }
+    if (d->nstates == RE_STATES) return -1;
+
+    struct dfa_state *st = d->states+d->nstates;
+    st->set = malloc(sizeof(int)*(n ? n : 1));
+    memcpy(st->set, set, sizeof(int)*n);
+    st->n = n;
+    st->hash = hash;
+
+    int row = d->nstates*d->stride, flags = n ? 0 : DFA_DEAD;
+    for (int i = 0; i < n; i++)
+        if (d->nfa[set[i]].type == NFA_MATCH) flags |= DFA_ACCEPT;
+    for (int k = 0; k < re->nclasses; k++) d->trans[row+k] = -1;
+    d->trans[row+re->nclasses] = flags;
+    d->table[h] = d->nstates++;
+    return row;
+}
+
+/* Row of the state to start from */
+static int dfa__start(struct regex *re, struct dfa *d) {
+    if (d->init < 0) {
+        int n = 0;
+        d->gen++;
+        dfa__closure(d, d->start, &n);
+        if ((d->init = dfa__state(re, d, d->buf, n)) < 0) {
+            dfa__flush(d);
+            d->init = dfa__state(re, d, d->buf, n);
+        }
+    }
+    return d->init;
+}
+
+/* Work out the state after <row> on class <k>.  When the cache is full
+   it is emptied, leaving only the new state: rows held by the caller are
+   no good after this, other than the one returned. */
+static int dfa__step(struct regex *re, struct dfa *d, int row, int k) {
+    struct dfa_state *st = d->states+row/d->stride;
+    int sym = re->rep[k], n = 0;
+    d->gen++;
+    for (int i = 0; i < st->n; i++) {
+        struct nfa_state *ns = d->nfa+st->set[i];
+        if (ns->type == NFA_SET && set_has(re->sets+ns->out1, sym))
+            dfa__closure(d, ns->out, &n);
+    }
+    /* BOL and EOL take no room: a ^ right after a ^ still sees the BOL */
+    for (int i = 0; sym >= RE_BOL && i < n; i++) {
+        struct nfa_state *ns = d->nfa+d->buf[i];
+        if (ns->type == NFA_SET && set_has(re->sets+ns->out1, sym))
+            dfa__closure(d, ns->out, &n);
+    }
+    int to = dfa__state(re, d, d->buf, n);
+    if (to < 0) {
+        dfa__flush(d);
+        return dfa__state(re, d, d->buf, n);
+    }
+    /* \n, and for the find DFA a step into a match, is left for the
+       scanning loops to notice by missing the table */
+    if (k != re->cls['\n'] && !(d == &re->find && (d->trans[to+re->nclasses] & DFA_ACCEPT)))
+        d->trans[row+k] = to;
+    return to;
+}
+
+static int dfa__next(struct regex *re, struct dfa *d, int row, int k) {
+    int to = d->trans[row+k];
+    return to >= 0 ? to : dfa__step(re, d, row, k);
+}
+
+#define dfa__flags(re, d, row) ((d)->trans[(row)+(re)->nclasses])
+
+/* ============================ Interface ============================ */
+
+/* Compile <pattern>, or return NULL with *err saying what is wrong */
+struct regex *regex_compile(const char *pattern, const char **err) {
+    struct regex *re = calloc(1, sizeof(struct regex));
+    re->p = pattern;
+    re->root = re__alt(re);
+    if (re->root >= 0 && *re->p == ')') re->err = "unmatched )";
+    if (re->root < 0 || re->err) {
+        *err = re->err;
+        regex_free(re);
+        return NULL;
+    }
+    re__literal(re);
+    dfa__init(re, &re->find, 0, 1);
+    dfa__init(re, &re->back, 1, 1);
+    dfa__init(re, &re->forward, 0, 0);
+    re__classes(re);
+    dfa__alloc(re, &re->find);
+    dfa__alloc(re, &re->back);
+    dfa__alloc(re, &re->forward);
+    return re;
+}
+
+void regex_free(struct regex *re) {
+    if (!re) return;
+    dfa__free(&re->find);
+    dfa__free(&re->back);
+    dfa__free(&re->forward);
+    free(re->sets);
+    free(re->nodes);
+    free(re->literal);
+    free(re);
+}
+
+/* Is there a match in the line s[0..n)? */
+static int regex__line(struct regex *re, const char *s, size_t n) {
+    struct dfa *d = &re->find;
+    const char *p = s, *end = s+n;
+    int row = dfa__start(re, d), to;
+    row = dfa__next(re, d, row, re->cls[RE_BOL]);
+    while (!(dfa__flags(re, d, row) & DFA_ACCEPT)) {
+        while (p < end && (to = d->trans[row+re->cls[(unsigned char)*p]]) >= 0) {
+            row = to;
+            p++;
+        }
+        if (p == end) {
+            row = dfa__next(re, d, row, re->cls[RE_EOL]);
+            return dfa__flags(re, d, row) & DFA_ACCEPT;
+        }
+        row = dfa__step(re, d, row, re->cls[(unsigned char)*p++]);
+    }
+    return 1;
+}
+
+/* Match in the line s[0..n): for <dir> > 0 the leftmost one starting at
+   <from> or later, otherwise the rightmost one starting before <from>.
+   Of those starting there the longest is taken. */
+int regex_match(struct regex *re, const char *s, size_t n, size_t from, int dir,
+                size_t *start, size_t *len) {
+    if (dir > 0 && from > n) return 0;
+    if (re->literal_len && !search_forward(s, n, re->literal, re->literal_len)) return 0;
+    if (!regex__line(re, s, n)) return 0;
+
+    /* backwards from EOL, the DFA accepts wherever a match starts */
+    struct dfa *d = &re->back;
+    long best = -1;
+    size_t i = n;
+    int row = dfa__start(re, d);
+    row = dfa__next(re, d, row, re->cls[RE_EOL]);
+    while (1) {
+        if (dfa__flags(re, d, row) & DFA_ACCEPT) {
+            if (dir > 0 && i >= from) best = i;
+            if (dir <= 0 && i < from) {
+                best = i;
+                break;
+            }
+        }
+        if (i == 0 || (dir > 0 && i == from)) break;
+        i--;
+        row = dfa__next(re, d, row, re->cls[(unsigned char)s[i]]);
+    }
+    if (i == 0 && best != 0 && (dir > 0 || from > 0)) {
+        row = dfa__next(re, d, row, re->cls[RE_BOL]);
+        if (dfa__flags(re, d, row) & DFA_ACCEPT) best = 0;
+    }
+    if (best < 0) return 0;
+
+    /* forwards from there, as far as a match goes */
+    d = &re->forward;
+    long end = -1;
+    size_t j = best;
+    row = dfa__start(re, d);
+    if (j == 0) row = dfa__next(re, d, row, re->cls[RE_BOL]);
+    if (dfa__flags(re, d, row) & DFA_ACCEPT) end = j;
+    while (j < n && !(dfa__flags(re, d, row) & DFA_DEAD)) {
+        row = dfa__next(re, d, row, re->cls[(unsigned char)s[j++]]);
+        if (dfa__flags(re, d, row) & DFA_ACCEPT) end = j;
+    }
+    if (j == n && !(dfa__flags(re, d, row) & DFA_DEAD)) {
+        row = dfa__next(re, d, row, re->cls[RE_EOL]);
+        if (dfa__flags(re, d, row) & DFA_ACCEPT) end = n;
+    }
+    if (end < 0) return 0;
+    *start = best;
+    *len = end-best;
+    return 1;
+}
+
+/* Start of the first of the \n separated lines in s[0..n) holding a match,
+   or NULL.  With a literal only lines holding it are looked at, otherwise
+   the whole text goes through the DFA in one pass. */
+const char *regex_find_line(struct regex *re, const char *s, size_t n) {
+    const char *end = s+n, *bol = s, *p;
+
+    if (re->literal_len) {
+        while (bol < end && (p = search_forward(bol, end-bol, re->literal, re->literal_len)) != NULL) {
+            const char *b = p, *e = memchr(p, '\n', end-p);
+            while (b > bol && b[-1] != '\n') b--;
+            if (!e) e = end;
+            if (regex__line(re, b, e-b)) return b;
+            bol = e+1;
+        }
+        return NULL;
+    }
+
+    struct dfa *d = &re->find;
+    int nl = re->cls['\n'], row, to;
+    for (p = s; bol < end; bol = ++p) {
+        row = dfa__start(re, d);
+        row = dfa__next(re, d, row, re->cls[RE_BOL]);
+        while (!(dfa__flags(re, d, row) & DFA_ACCEPT)) {
+            /* the table misses on \n, on a match and on states not seen yet */
+            while (p < end && (to = d->trans[row+re->cls[(unsigned char)*p]]) >= 0) {
+                row = to;
+                p++;
+            }
+            if (p == end || re->cls[(unsigned char)*p] == nl) {
+                row = dfa__next(re, d, row, re->cls[RE_EOL]);
+                if (dfa__flags(re, d, row) & DFA_ACCEPT) return bol;
+                break;
+            }
+            row = dfa__step(re, d, row, re->cls[(unsigned char)*p++]);
+        }
+        if (dfa__flags(re, d, row) & DFA_ACCEPT) return bol;
+    }
+    return NULL;
+}
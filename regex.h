@@ -0,0 +1,7 @@
+struct regex;
+
+struct regex *regex_compile(const char *pattern, const char **err);
+void regex_free(struct regex *re);
+int regex_match(struct regex *re, const char *s, size_t n, size_t from, int dir,
+                size_t *start, size_t *len);
+const char *regex_find_line(struct regex *re, const char *s, size_t n);
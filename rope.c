@@ -0,0 +1,508 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "structures.h"
+#include "rope.h"
+
+/* ============================ Line rope ============================
+ *
+ * The lines of a buffer live in a B+tree: leaves hold up to ROPE_LEAF
+ * struct line by value, internal nodes hold up to ROPE_FANOUT children and
+ * every node knows how many lines are below it, and how many chars.  Looking
+ * up, inserting and deleting line <at>, or the line at a byte offset, walks
+ * one root-to-leaf path, so costs O(log n) however large the buffer is.
+ *
+ * As with the old flat array, a struct line * is only good until the next
+ * insert or delete: lines move around inside and between leaves.
+ *
+ * Nodes are reference counted so that rope_snapshot() can share the whole
+ * tree in O(1).  Changing the tree (rope_get_mut(), rope_insert()...) then
+ * copies each shared node on the way down before touching it, so the
+ * snapshot keeps its lines and their chars and size as they were.  Lines
+ * of a copied leaf are marked pinned: their chars still belong to the
+ * snapshot too.  Only the thread owning the rope changes reference
+ * counts, so a snapshot can be read from another thread.
+ *
+ * What is worked out from the chars is not worth a copy, though: the
+ * render, rsize, hl and hl_* of lines got with rope_get() or rope_span()
+ * are set in place even when a snapshot shares their leaf, see
+ * buffer_render_line() and editorUpdateSyntax().  A snapshot is only good
+ * for the chars and size of its lines: the others may change under it,
+ * and it never reads or frees them.
+ *
+ * When soft wrapping, every node also knows how many screen rows its lines
+ * take, and the widest of them (line->rsize, the columns a line takes
+ * drawn).  So the line at a screen row, and the row of a line, are found
+ * on one path too.  A new window width only changes the rows of lines
+ * wider than it was or is: the subtrees whose widest line is narrower
+ * than both are passed over.
+ */
+
+#define ROPE_LEAF 64
+#define ROPE_FANOUT 32
+
+struct rope_node {
+    int leaf;           /* holds lines (1) or kids (0) */
+    int n;              /* number of lines or kids in use */
+    int count;          /* number of lines in this subtree */
+    size_t chars;       /* chars of those lines, newlines not counted */
+    int rows, wide;     /* screen rows they take and widest of them, see rope_wrap() */
+    int refs;           /* parents and ropes pointing here */
+    union {
+        struct line lines[ROPE_LEAF];
+        struct rope_node *kids[ROPE_FANOUT];
+    } u;
+};
+
+static struct rope_node *rope__new(int leaf) {
+    struct rope_node *node = malloc(sizeof(*node));
+    node->leaf = leaf;
+    node->n = 0;
+    node->count = 0;
+    node->chars = 0;
+    node->rows = node->wide = 0;
+    node->refs = 1;
+    return node;
+}
+
+/* Screen rows of a line <width> columns wide, at <wrap> columns a row;
+   lines not measured yet (-1) count as one */
+static int rope__rows(int width, int wrap) {
+    return width < wrap ? 1 : 1 + width/wrap;
+}
+
+/* Work out the chars of <node> from its lines or kids, and when wrapping
+   at <wrap> columns a row its rows and widest line */
+static void rope__sum(struct rope_node *node, int wrap) {
+    node->chars = 0;
+    node->rows = node->wide = 0;
+    for (int i = 0; i < node->n; i++) {
+        int rows, wide;
+        if (node->leaf) {
+            node->chars += node->u.lines[i].size;
+            if (!wrap) continue;
+            wide = node->u.lines[i].rsize;
+            rows = rope__rows(wide, wrap);
+        } else {
+            node->chars += node->u.kids[i]->chars;
+            wide = node->u.kids[i]->wide;
+            rows = node->u.kids[i]->rows;
+        }
+        node->rows += rows;
+        if (wide > node->wide) node->wide = wide;
+    }
+}
+
+static void rope__unref(struct rope_node *node) {
+    if (--node->refs) return;
+    if (!node->leaf)
+        for (int i = 0; i < node->n; i++) rope__unref(node->u.kids[i]);
+    free(node);
+}
+
+/* Make *slot a node of our own, copying it if a snapshot shares it */
+static struct rope_node *rope__own(struct rope_node **slot) {
+    struct rope_node *node = *slot;
+    if (node->refs == 1) return node;
+    struct rope_node *copy = rope__new(node->leaf);
+    copy->n = node->n;
+    copy->count = node->count;
+    copy->chars = node->chars;
+    copy->rows = node->rows;
+    copy->wide = node->wide;
+    if (node->leaf) {
+        memcpy(copy->u.lines, node->u.lines, sizeof(struct line)*node->n);
+        for (int i = 0; i < copy->n; i++) copy->u.lines[i].pinned = 1;
+    } else {
+        memcpy(copy->u.kids, node->u.kids, sizeof(struct rope_node *)*node->n);
+        for (int i = 0; i < copy->n; i++) copy->u.kids[i]->refs++;
+    }
+    node->refs--;
+    return *slot = copy;
+}
+
+/* Leaf holding line <at>, with <at> made relative to that leaf */
+static struct rope_node *rope__leaf(struct rope *r, int *at) {
+    struct rope_node *node = r->root;
+    if (!node || *at < 0 || *at >= node->count) return NULL;
+    while (!node->leaf) {
+        int i = 0;
+        while (*at >= node->u.kids[i]->count) *at -= node->u.kids[i++]->count;
+        node = node->u.kids[i];
+    }
+    return node;
+}
+
+struct line *rope_get(struct rope *r, int at) {
+    struct rope_node *leaf = rope__leaf(r, &at);
+    return leaf ? leaf->u.lines+at : NULL;
+}
+
+/* Line <at> for changing: shared nodes on the way are copied first */
+struct line *rope_get_mut(struct rope *r, int at) {
+    if (!r->root || at < 0 || at >= r->root->count) return NULL;
+    struct rope_node *node = rope__own(&r->root);
+    while (!node->leaf) {
+        int i = 0;
+        while (at >= node->u.kids[i]->count) at -= node->u.kids[i++]->count;
+        node = rope__own(&node->u.kids[i]);
+    }
+    return node->u.lines+at;
+}
+
+/* Line <at>, and in *n how many lines from it on are contiguous in memory */
+struct line *rope_span(struct rope *r, int at, int *n) {
+    struct rope_node *leaf = rope__leaf(r, &at);
+    if (!leaf) {
+        *n = 0;
+        return NULL;
+    }
+    *n = leaf->n - at;
+    return leaf->u.lines+at;
+}
+
+/* Move the entries of <node> from <keep> on into a new right sibling */
+static struct rope_node *rope__split(struct rope_node *node, int keep) {
+    struct rope_node *sib = rope__new(node->leaf);
+    sib->n = node->n - keep;
+    if (node->leaf) {
+        memcpy(sib->u.lines, node->u.lines+keep, sizeof(struct line)*sib->n);
+        sib->count = sib->n;
+    } else {
+        memcpy(sib->u.kids, node->u.kids+keep, sizeof(struct rope_node *)*sib->n);
+        for (int i = 0; i < sib->n; i++) sib->count += sib->u.kids[i]->count;
+    }
+    rope__sum(sib, 0);
+    node->n = keep;
+    node->count -= sib->count;
+    node->chars -= sib->chars;
+    return sib;
+}
+
+/* Make room for a line of <size> chars at <at> below <node>, pointed to by
+   *line.  Returns the new right sibling of <node> if it had to split. */
+static struct rope_node *rope__insert(struct rope_node *node, int at, int size,
+                                      struct line **line, int wrap) {
+    struct rope_node *sib = NULL, *left = node;
+
+    if (node->leaf) {
+        if (node->n == ROPE_LEAF) {
+            /* appending leaves the old leaf full: sequential loads pack tight */
+            sib = rope__split(node, at == node->n ? node->n : node->n/2);
+            if (at > node->n || node->n == ROPE_LEAF) {
+                at -= node->n;
+                node = sib;
+            }
+        }
+        memmove(node->u.lines+at+1, node->u.lines+at, sizeof(struct line)*(node->n-at));
+        memset(node->u.lines+at, 0, sizeof(struct line));
+        node->u.lines[at].size = size;
+        node->n++;
+        node->count++;
+        node->chars += size;
+        *line = node->u.lines+at;
+        if (wrap) rope__sum(left, wrap);
+        if (wrap && sib) rope__sum(sib, wrap);
+        return sib;
+    }
+
+    int i = 0;
+    while (i < node->n-1 && at > node->u.kids[i]->count) at -= node->u.kids[i++]->count;
+    struct rope_node *kid = rope__insert(rope__own(&node->u.kids[i]), at, size, line, wrap);
+    node->count++;
+    node->chars += size;
+    if (!kid) {
+        if (wrap) rope__sum(node, wrap);
+        return NULL;
+    }
+
+    int slot = i+1;
+    if (node->n == ROPE_FANOUT) {
+        sib = rope__split(node, slot == node->n ? node->n : node->n/2);
+        if (slot > node->n || node->n == ROPE_FANOUT) {
+            slot -= node->n;
+            node->count -= kid->count;
+            sib->count += kid->count;
+            node->chars -= kid->chars;
+            sib->chars += kid->chars;
+            node = sib;
+        }
+    }
+    memmove(node->u.kids+slot+1, node->u.kids+slot, sizeof(struct rope_node *)*(node->n-slot));
+    node->u.kids[slot] = kid;
+    node->n++;
+    if (wrap) rope__sum(left, wrap);
+    if (wrap && sib) rope__sum(sib, wrap);
+    return sib;
+}
+
+/* Insert a line of <size> chars at <at> (0 ≤ at ≤ count); returns it
+   blank but for its size, for the caller to fill */
+struct line *rope_insert(struct rope *r, int at, int size) {
+    struct line *line;
+    if (!r->root) r->root = rope__new(1);
+    if (at < 0 || at > r->root->count) return NULL;
+    struct rope_node *sib = rope__insert(rope__own(&r->root), at, size, &line, r->wrap);
+    if (sib) {
+        struct rope_node *root = rope__new(0);
+        root->u.kids[0] = r->root;
+        root->u.kids[1] = sib;
+        root->n = 2;
+        root->count = r->root->count + sib->count;
+        rope__sum(root, r->wrap);
+        r->root = root;
+    }
+    return line;
+}
+
+/* Add a full leaf of zeroed lines at the end of <r>, hung off the right
+   edge of the tree: a whole file goes in a leaf at a time, without
+   walking down to each line or knowing how many there are.  Returns the
+   lines, and in *n how many, for the caller to fill; those left over are
+   cut with rope_delete(), and the rope counted with rope_sum(). */
+struct line *rope_append(struct rope *r, int *n) {
+    struct rope_node *leaf = rope__new(1), *path[32];
+    memset(leaf->u.lines, 0, sizeof(leaf->u.lines));
+    leaf->n = leaf->count = *n = ROPE_LEAF;
+    if (!r->root) {
+        r->root = leaf;
+        return leaf->u.lines;
+    }
+
+    /* the right edge, and the lowest node on it with room for a kid */
+    int depth = 0, room = -1;
+    for (struct rope_node *node = rope__own(&r->root); !node->leaf;
+         node = rope__own(&node->u.kids[node->n-1])) {
+        if (node->n < ROPE_FANOUT) room = depth;
+        path[depth++] = node;
+    }
+    if (room < 0) {
+        struct rope_node *root = rope__new(0);
+        root->u.kids[0] = r->root;
+        root->n = 1;
+        root->count = r->root->count;
+        r->root = root;
+        memmove(path+1, path, sizeof(path[0])*depth++);
+        path[room = 0] = root;
+    }
+    /* a new edge from there down to the leaf, keeping leaves level */
+    struct rope_node *kid = leaf;
+    for (int i = depth-1; i > room; i--) {
+        struct rope_node *node = rope__new(0);
+        node->u.kids[0] = kid;
+        node->n = 1;
+        node->count = kid->count;
+        kid = node;
+    }
+    path[room]->u.kids[path[room]->n++] = kid;
+    for (int i = 0; i <= room; i++) path[i]->count += ROPE_LEAF;
+    return leaf->u.lines;
+}
+
+/* Fold kid i+1 of <node> into kid i */
+static void rope__merge(struct rope_node *node, int i) {
+    struct rope_node *left = rope__own(&node->u.kids[i]), *right = node->u.kids[i+1];
+    if (left->leaf) {
+        memcpy(left->u.lines+left->n, right->u.lines, sizeof(struct line)*right->n);
+        if (right->refs > 1)
+            for (int j = 0; j < right->n; j++) left->u.lines[left->n+j].pinned = 1;
+    } else {
+        memcpy(left->u.kids+left->n, right->u.kids, sizeof(struct rope_node *)*right->n);
+        for (int j = 0; j < right->n; j++) right->u.kids[j]->refs++;
+    }
+    left->n += right->n;
+    left->count += right->count;
+    left->chars += right->chars;
+    rope__unref(right);
+    memmove(node->u.kids+i+1, node->u.kids+i+2, sizeof(struct rope_node *)*(node->n-i-2));
+    node->n--;
+}
+
+/* Remove line <at> below <node>; returns its size */
+static int rope__delete(struct rope_node *node, int at, int wrap) {
+    node->count--;
+    if (node->leaf) {
+        int size = node->u.lines[at].size;
+        memmove(node->u.lines+at, node->u.lines+at+1, sizeof(struct line)*(node->n-at-1));
+        node->n--;
+        node->chars -= size;
+        if (wrap) rope__sum(node, wrap);
+        return size;
+    }
+
+    int i = 0;
+    while (at >= node->u.kids[i]->count) at -= node->u.kids[i++]->count;
+    struct rope_node *kid = rope__own(&node->u.kids[i]);
+    int size = rope__delete(kid, at, wrap);
+    node->chars -= size;
+
+    /* keep nodes at least half full by merging an underfull kid with a neighbour */
+    int cap = kid->leaf ? ROPE_LEAF : ROPE_FANOUT;
+    if (kid->n == 0) {
+        free(kid);
+        memmove(node->u.kids+i, node->u.kids+i+1, sizeof(struct rope_node *)*(node->n-i-1));
+        node->n--;
+    } else if (kid->n < cap/2) {
+        if (i+1 < node->n && kid->n + node->u.kids[i+1]->n <= cap)
+            rope__merge(node, i);
+        else if (i > 0 && kid->n + node->u.kids[i-1]->n <= cap)
+            rope__merge(node, --i);
+        if (wrap) rope__sum(node->u.kids[i], wrap);
+    }
+    if (wrap) rope__sum(node, wrap);
+    return size;
+}
+
+/* Remove line <at>; its contents are the caller's to free beforehand */
+void rope_delete(struct rope *r, int at) {
+    if (!r->root || at < 0 || at >= r->root->count) return;
+    rope__delete(rope__own(&r->root), at, r->wrap);
+    while (!r->root->leaf && r->root->n == 1) {
+        struct rope_node *root = r->root;
+        r->root = root->u.kids[0];
+        free(root);
+    }
+}
+
+/* Line <at> changed size or width: redo the sums of the nodes above it */
+void rope_update(struct rope *r, int at) {
+    struct rope_node *path[32];
+    int depth = 0;
+    if (!r->root || at < 0 || at >= r->root->count) return;
+    struct rope_node *node = path[depth++] = rope__own(&r->root);
+    while (!node->leaf) {
+        int i = 0;
+        while (at >= node->u.kids[i]->count) at -= node->u.kids[i++]->count;
+        node = path[depth++] = rope__own(&node->u.kids[i]);
+    }
+    while (depth) rope__sum(path[--depth], r->wrap);
+}
+
+static void rope__sum_all(struct rope_node *node, int wrap) {
+    if (!node->leaf)
+        for (int i = 0; i < node->n; i++) rope__sum_all(node->u.kids[i], wrap);
+    rope__sum(node, wrap);
+}
+
+/* Work out the sums of every node afresh, after rope_append() */
+void rope_sum(struct rope *r) {
+    if (r->root) rope__sum_all(r->root, r->wrap);
+}
+
+/* Drop the tree; line contents are the caller's to free beforehand */
+void rope_free(struct rope *r) {
+    if (r->root) rope__unref(r->root);
+    r->root = NULL;
+}
+
+/* Share the tree of <r> with *snap, whose lines keep their chars and size
+   as they are now until freed */
+void rope_snapshot(struct rope *r, struct rope *snap) {
+    snap->root = r->root;
+    snap->wrap = 0;
+    if (snap->root) snap->root->refs++;
+}
+
+/* ============================ Soft wrap ============================ */
+
+/* Redo the rows of <node> at <wrap> columns a row, where they were not
+   known or were counted at <old> columns (0 if not at all) */
+static void rope__wrap(struct rope_node **slot, int old, int wrap) {
+    struct rope_node *node = *slot;
+    if (old && node->wide < old && node->wide < wrap) return;
+    node = rope__own(slot);
+    if (!node->leaf)
+        for (int i = 0; i < node->n; i++) rope__wrap(&node->u.kids[i], old, wrap);
+    rope__sum(node, wrap);
+}
+
+/* Count the screen rows of lines <cols> columns a row from now on, or
+   stop if 0.  The caller measures the lines first (line->rsize). */
+void rope_wrap(struct rope *r, int cols) {
+    if (r->root && cols) rope__wrap(&r->root, r->wrap, cols);
+    r->wrap = cols;
+}
+
+/* Screen row line <at> starts at; past the end each line takes one */
+int rope_row(struct rope *r, int at) {
+    struct rope_node *node = r->root;
+    int row = 0;
+    if (!node) return at;
+    if (at >= node->count) return node->rows + at-node->count;
+    while (!node->leaf) {
+        int i = 0;
+        for (; at >= node->u.kids[i]->count; i++) {
+            at -= node->u.kids[i]->count;
+            row += node->u.kids[i]->rows;
+        }
+        node = node->u.kids[i];
+    }
+    for (int i = 0; i < at; i++) row += rope__rows(node->u.lines[i].rsize, r->wrap);
+    return row;
+}
+
+/* Line holding screen row *row, which is made relative to the line's first */
+int rope_row_line(struct rope *r, int *row) {
+    struct rope_node *node = r->root;
+    int at = 0;
+    if (!node) return *row;
+    if (*row >= node->rows) {
+        at = node->count + *row-node->rows;
+        *row = 0;
+        return at;
+    }
+    while (!node->leaf) {
+        int i = 0;
+        for (; *row >= node->u.kids[i]->rows; i++) {
+            *row -= node->u.kids[i]->rows;
+            at += node->u.kids[i]->count;
+        }
+        node = node->u.kids[i];
+    }
+    for (int i = 0; ; i++, at++) {
+        int rows = rope__rows(node->u.lines[i].rsize, r->wrap);
+        if (*row < rows) break;
+        *row -= rows;
+    }
+    return at;
+}
+
+/* ========================== Byte offsets ========================== */
+
+/* Offset of line <at> in the text, each line ended by a newline */
+size_t rope_offset(struct rope *r, int at) {
+    struct rope_node *node = r->root;
+    size_t off = 0;
+    if (!node) return 0;
+    if (at >= node->count) return node->chars + node->count;
+    while (!node->leaf) {
+        int i = 0;
+        for (; at >= node->u.kids[i]->count; i++) {
+            at -= node->u.kids[i]->count;
+            off += node->u.kids[i]->chars + node->u.kids[i]->count;
+        }
+        node = node->u.kids[i];
+    }
+    for (int i = 0; i < at; i++) off += node->u.lines[i].size+1;
+    return off;
+}
+
+/* Line holding text offset *off, which is made relative to the line's
+   start; the line count if past the end */
+int rope_offset_line(struct rope *r, size_t *off) {
+    struct rope_node *node = r->root;
+    int at = 0;
+    if (!node || *off >= node->chars + node->count) return node ? node->count : 0;
+    while (!node->leaf) {
+        int i = 0;
+        for (; *off >= node->u.kids[i]->chars + node->u.kids[i]->count; i++) {
+            *off -= node->u.kids[i]->chars + node->u.kids[i]->count;
+            at += node->u.kids[i]->count;
+        }
+        node = node->u.kids[i];
+    }
+    for (int i = 0; *off > (size_t)node->u.lines[i].size; i++, at++)
+        *off -= node->u.lines[i].size+1;
+    return at;
+}
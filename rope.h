@@ -0,0 +1,18 @@
+struct rope;
+struct line;
+
+struct line *rope_get(struct rope *r, int at);
+struct line *rope_get_mut(struct rope *r, int at);
+struct line *rope_span(struct rope *r, int at, int *n);
+struct line *rope_insert(struct rope *r, int at, int size);
+struct line *rope_append(struct rope *r, int *n);
+void rope_delete(struct rope *r, int at);
+void rope_free(struct rope *r);
+void rope_snapshot(struct rope *r, struct rope *snap);
+void rope_update(struct rope *r, int at);
+void rope_sum(struct rope *r);
+void rope_wrap(struct rope *r, int cols);
+int rope_row(struct rope *r, int at);
+int rope_row_line(struct rope *r, int *row);
+size_t rope_offset(struct rope *r, int at);
+int rope_offset_line(struct rope *r, size_t *off);
@@ -0,0 +1,92 @@
+#include <stddef.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "search.h"
+
+/* ========================== Substring search ==========================
+ *
+ * Candidates are positions where both the first and the last byte of the
+ * needle match; only those get a memcmp of the bytes in between.  With
+ * SSE2 both bytes are compared for 16 positions at once, otherwise memchr
+ * finds the first byte.  Real text rarely matches both ends by chance, so
+ * either way most of the haystack is passed over without a memcmp.
+ */
+
+#ifdef __SSE2__
+static const char *search__sse2(const char *s, size_t n, const char *needle, size_t m) {
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[m-1]);
+    size_t i = 0;
+
+    for (; i + m-1 + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(s+i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(s+i+m-1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a,first),
+                                                        _mm_cmpeq_epi8(b,last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (!memcmp(s+i+bit+1, needle+1, m-2)) return s+i+bit;
+            mask &= mask-1;
+        }
+    }
+    /* fewer than 16 positions left */
+    for (; i + m <= n; i++)
+        if (s[i] == needle[0] && s[i+m-1] == needle[m-1] && !memcmp(s+i+1, needle+1, m-2))
+            return s+i;
+    return NULL;
+}
+#else
+static const char *search__scalar(const char *s, size_t n, const char *needle, size_t m) {
+    const char *end = s+n-m+1, *p = s;
+    while (p < end && (p = memchr(p, needle[0], end-p)) != NULL) {
+        if (p[m-1] == needle[m-1] && !memcmp(p+1, needle+1, m-2)) return p;
+        p++;
+    }
+    return NULL;
+}
+#endif
+
+/* First occurrence of needle[0..m) in s[0..n), or NULL */
+const char *search_forward(const char *s, size_t n, const char *needle, size_t m) {
+    if (m == 0) return s;
+    if (m > n) return NULL;
+    if (m == 1) return memchr(s, needle[0], n);
+#ifdef __SSE2__
+    return search__sse2(s, n, needle, m);
+#else
+    return search__scalar(s, n, needle, m);
+#endif
+}
+
+/* Last occurrence of needle[0..m) in s[0..n), or NULL */
+const char *search_backward(const char *s, size_t n, const char *needle, size_t m) {
+    const char *found = NULL, *p;
+    size_t at = 0;
+    if (m == 0) return s+n;
+    while ((p = search_forward(s+at, n-at, needle, m)) != NULL) {
+        found = p;
+        at = p-s+1;
+    }
+    return found;
+}
+
+/* Number of bytes equal to <c> in s[0..n) */
+size_t search_count(const char *s, size_t n, char c) {
+    size_t count = 0, i = 0;
+#ifdef __SSE2__
+    /* each byte lane counts up to 255 hits before the lanes are summed */
+    const __m128i v = _mm_set1_epi8(c), zero = _mm_setzero_si128();
+    while (i + 16 <= n) {
+        __m128i acc = zero;
+        for (int k = 0; k < 255 && i + 16 <= n; k++, i += 16)
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s+i)), v));
+        __m128i sum = _mm_sad_epu8(acc, zero);
+        count += _mm_cvtsi128_si32(sum) + _mm_extract_epi16(sum, 4);
+    }
+#endif
+    for (; i < n; i++) count += s[i] == c;
+    return count;
+}
@@ -0,0 +1,3 @@
+const char *search_forward(const char *s, size_t n, const char *needle, size_t m);
+const char *search_backward(const char *s, size_t n, const char *needle, size_t m);
+size_t search_count(const char *s, size_t n, char c);
@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "structures.h"
+#include "slab.h"
+
+/* ========================= Line storage =========================
+ *
+ * The chars, render and hl of every line come from here rather than from
+ * malloc one by one.  Blocks are carved off the end of large chunks and
+ * come in size classes: every 8 bytes up to 256, then powers of two up to
+ * SLAB_LARGE.  A freed block goes on the free list of its class for the
+ * next block of that size, so there is no per-block header and no search.
+ * Larger blocks, rare long lines, are malloc'ed and kept on a list.
+ *
+ * Callers pass the size they asked for again when freeing, and may use all
+ * of slab_size() of it: that is what lets a line grow geometrically in
+ * place.  slab_free_all() hands back everything at once, a few chunks
+ * rather than a free per line.
+ */
+
+#define SLAB_SMALL 256          /* classes every 8 bytes up to here */
+#define SLAB_LARGE 4096         /* larger blocks are malloc'ed */
+#define SLAB_CHUNK (64UL<<10)   /* first chunk, later ones double ... */
+#define SLAB_CHUNK_MAX (64UL<<20) /* ... up to this */
+
+/* Heads both chunks and large blocks, on their lists in struct slab */
+struct slab_chunk {
+    struct slab_chunk *prev, *next;
+    size_t size;
+};
+
+static int slab__class(size_t size) {
+    if (size <= SLAB_SMALL) return size ? (size-1)/8 : 0;
+    int c = SLAB_SMALL/8;
+    for (size_t s = 2*SLAB_SMALL; s < size; s *= 2) c++;
+    return c;
+}
+
+/* Bytes actually available in a block asked for with <size> */
+size_t slab_size(size_t size) {
+    if (size > SLAB_LARGE) return size;
+    if (size <= SLAB_SMALL) return size ? (size+7) & ~(size_t)7 : 8;
+    size_t s = 2*SLAB_SMALL;
+    while (s < size) s *= 2;
+    return s;
+}
+
+static struct slab_chunk *slab__link(struct slab_chunk **list, size_t size) {
+    struct slab_chunk *chunk = malloc(sizeof(*chunk)+size);
+    chunk->size = size;
+    chunk->prev = NULL;
+    chunk->next = *list;
+    if (*list) (*list)->prev = chunk;
+    return *list = chunk;
+}
+
+/* A block of at least <size> bytes, slab_size(size) in fact */
+void *slab_alloc(struct slab *s, size_t size) {
+    if (size > SLAB_LARGE) return slab__link(&s->large,size)+1;
+
+    int c = slab__class(size);
+    void *p = s->free[c];
+    if (p) {
+        memcpy(&s->free[c],p,sizeof(void *));
+        return p;
+    }
+    size = slab_size(size);
+    if ((size_t)(s->end - s->next) < size) {
+        s->chunksize = s->chunksize ? s->chunksize*2 : SLAB_CHUNK;
+        if (s->chunksize > SLAB_CHUNK_MAX) s->chunksize = SLAB_CHUNK_MAX;
+        struct slab_chunk *chunk = slab__link(&s->chunks,s->chunksize);
+        s->next = (char *)(chunk+1);
+        s->end = s->next+chunk->size;
+    }
+    p = s->next;
+    s->next += size;
+    return p;
+}
+
+/* Give back block <p>, that slab_alloc(s,<size>) returned */
+void slab_free(struct slab *s, void *p, size_t size) {
+    if (!p) return;
+    if (size > SLAB_LARGE) {
+        struct slab_chunk *block = (struct slab_chunk *)p-1;
+        if (block->prev) block->prev->next = block->next;
+        else s->large = block->next;
+        if (block->next) block->next->prev = block->prev;
+        free(block);
+        return;
+    }
+    int c = slab__class(size);
+    memcpy(p,&s->free[c],sizeof(void *));
+    s->free[c] = p;
+}
+
+/* Give back every block at once */
+void slab_free_all(struct slab *s) {
+    struct slab_chunk *chunk, *next;
+    for (chunk = s->chunks; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    for (chunk = s->large; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    memset(s,0,sizeof(*s));
+}
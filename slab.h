@@ -0,0 +1,6 @@
+struct slab;
+
+size_t slab_size(size_t size);
+void *slab_alloc(struct slab *s, size_t size);
+void slab_free(struct slab *s, void *p, size_t size);
+void slab_free_all(struct slab *s);
@@ -1,26 +1,105 @@
+#include <time.h>
 
+/* A language: which files are in it and how it is highlighted.  Strings
+   are NULL or "" for none. */
 struct editorSyntax {
     char **filematch;
     char **keywords;
-    char singleline_comment_start[2];
-    char multiline_comment_start[3];
-    char multiline_comment_end[3];
+    char *singleline_comment_start;
+    char *multiline_comment_start;
+    char *multiline_comment_end;
+    char *separators;   /* chars that end words, besides blanks */
+    char *quotes;       /* chars strings are quoted with */
+    char *number_chars; /* chars numbers go on with, besides digits */
     int flags;
+    struct lexer *lexer;    /* all the above compiled, on first use, see highlights.c */
 };
 typedef struct hlcolor {
     int r,g,b;
 } hlcolor;
 
+/* Chars start..start+len of a rendered line are of syntactic type hl (HL_*);
+   longer spans take several runs */
+#define HLRUN_MAX 65535
+struct hlrun {
+    int start;
+    unsigned short len;
+    unsigned char hl;
+};
+
+/* Where the highlighter is at the start of a chunk of a long line */
+struct hlstate {
+    unsigned char state;    /* lexer state, LX_* in highlights.c */
+    unsigned char string;   /* in a string opened by this quote, or 0 */
+    unsigned char skip;     /* chars of the chunk already classed ... */
+    unsigned char skiphl;   /* ... as this, eg. the end of a keyword */
+};
+
+/* A piece of a long line, see chunk.c */
+struct chunk {
+    char *chars;
+    int size;
+    int cap;            /* bytes from E.buffer.store, 0 if in line->chars */
+    int col;            /* column of chars[0] in the line ... */
+    int rcol;           /* ... and in its render */
+    struct hlstate hl;  /* state highlighting enters it in */
+    unsigned char tabs; /* holds a TAB */
+};
+
+/* The entries of a chunk are its rcol and hl, and "entry n" is end */
+struct chunks {
+    int n, cap;         /* chunks in c[], room for */
+    int valid;          /* entries [0,valid) are right, ... */
+    int known;          /* [0,known) were worked out once ... */
+    int dirty;          /* ... and [dirty,known) still are, but for rcol */
+    int tabs;           /* chunks holding a TAB */
+    int flat;           /* line->chars hold the whole line, the chunks point in there */
+    struct hlstate end; /* state at the end of the line */
+    struct chunk c[];
+};
+
 struct line {
-    int idx;            /* index of line in file */
     int size;           /* line length, excl \0 */
-    int rsize;          /* sizeof rendered line */
+    int cap;            /* bytes of chars from E.buffer.store, 0 if in the mapped file */
+    int rsize;          /* sizeof rendered line, its width even when not kept;
+                           -1 until measured, see buffer_line_width() */
+    unsigned char hl_ic;    /* line highlighted as starting in open comment */
+    unsigned char hl_oc;    /* line ends with open comment */
+    unsigned char hl_stale; /* edited since last highlighted */
+    unsigned char pinned;   /* chars may be shared with a snapshot being saved */
     char *chars;        /* contents */
-    char *render;       /* rendered contents eg. TABs expanded */
-    unsigned char *hl;  /* Syntactic type of corresponding char in render: uses DEFINES */
-    int hl_oc;          /* line ends with open comment */
+    char *render;       /* rendered contents eg. TABs expanded, rsize+1 bytes;
+                           chars itself when the line has no TABs */
+    struct hlrun *hl;   /* spans of render not HL_NORMAL, ended by one of len 0;
+                           NULL until highlighted and whenever rendered again */
+    struct chunks *chunks;  /* long lines: the line in pieces, chars and render
+                               not kept up to date, see chunk.c; else NULL */
 };			/* line of file */
 
+struct rope {
+    struct rope_node *root;  /* B+tree of struct line, see rope.c */
+    int wrap;                /* columns of a screen row when soft wrapping, else 0 */
+};
+
+#define SLAB_CLASSES 36
+struct slab {
+    void *free[SLAB_CLASSES];   /* freed blocks of each size class, see slab.c */
+    char *next, *end;           /* unused part of the newest chunk */
+    struct slab_chunk *chunks, *large;
+    size_t chunksize;
+};
+
+struct mapping {
+    char *data;     /* mmap of the file, or NULL */
+    size_t len;
+    size_t indexed; /* bytes of data already split into lines */
+    /* The file on disk, for saving in place: see buffer_write_tail() */
+    unsigned long long dev, ino, size;
+    int ondisk;     /* file still holds the mapped lines at their offsets */
+    int tail;       /* lines from here on were rewritten by a save ... */
+    long long tail_off; /* ... starting at this offset */
+};
+
 struct point {
   int row;
   int col;
@@ -28,20 +107,38 @@ struct point {
 
 struct buffer {
     struct point point;    
-    struct line *lines;
-    int numlines;
+    struct rope lines;
+    struct slab store;  /* chars, render and hl of the lines */
+    int numlines;   /* lines indexed so far, see buffer_index_lines() */
+    int ragged;     /* chunked lines edited since their chars were whole */
+    struct mapping map;  /* large files: unedited lines point in here */
     int dirty;      /* file modified */
+    int dirty_from; /* lowest line modified since the last save */
     char *filename;
     struct editorSyntax *syntax;    /* Current syntax highlight, or NULL. */
     struct point offset; /* imagine entire buffer displayed, but top-left of screen is at offest */
+    int hl_stale;   /* lines from here on may need highlighting, see editorUpdateSyntax() */
+    int wrap_top;   /* soft wrap: screen row of the buffer at the top of the window, see rope_row() */
 };
 struct terminal {
     struct point winsize;
     int rawmode;    /* terminal in raw mode? */
 };
+struct found {
+    int row, col;       /* in the buffer, col in chars */
+    const char *chars;  /* the matching chars themselves */
+};
+struct match {
+    int row, col;   /* current match, col in chars */
+    int len;        /* 0: nothing to show */
+    struct found *all;  /* every match in buffer order, NULL if too many to keep */
+    int count;      /* number of matches in the buffer */
+    int k;          /* all[k] is the current one */
+};
 struct editor {
     struct buffer buffer;
     struct terminal terminal;
+    struct match match;  /* search match to highlight */
     char statusmsg[80];
     time_t statusmsg_time;
 };
@@ -53,23 +150,33 @@ enum SPECIAL_KEY {
         CTRL_C = 3,    
         CTRL_D = 4,    
         CTRL_F = 6,    
+        CTRL_G = 7,
         CTRL_H = 8,    
         TAB = 9,       
         CTRL_L = 12,   
         CTRL_M = 13,   
         CTRL_N = 14,   
+        CTRL_O = 15,
         CTRL_Y = 25,   
         CTRL_K = 11,   
         CTRL_P = 16,        
+        CTRL_R = 18,
         META_F = 230,        
         CTRL_Q = 17,   
         CTRL_S = 19,   
+        CTRL_T = 20,
         CTRL_U = 21,   
+        CTRL_W = 23,
+        CTRL_Z = 26,
         ESC = 27,      
         DEL =  127,
         /* soft codes, not really reported by terminal */
         HOME_KEY = 1005,
         END_KEY,
         PAGE_UP,
-        PAGE_DOWN
+        PAGE_DOWN,
+        PASTE,          /* bracketed paste, text from term_paste() */
+        RESIZE,         /* terminal window changed size */
+        TIMER,          /* echo area message expired */
+        NOTIFY          /* a worker thread is done, see term_watch() */
 };
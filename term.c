@@ -9,9 +9,10 @@
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
 
 #include "structures.h"
-#include "draw.h"
 
 static struct termios orig_termios;
 
@@ -31,8 +32,8 @@ static int term__switch_raw_mode(int fd, int on) {
 
     struct termios raw = orig_termios; 
     cfmakeraw(&raw);
-    raw.c_cc[VMIN] = 0; 
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VMIN] = 1; /* reads only follow a poll(), see term__wait() */
+    raw.c_cc[VTIME] = 0;
     if (tcsetattr(fd,TCSAFLUSH,&raw) < 0) goto fatal;
     E.terminal.rawmode = 1;
     return 0;
@@ -43,7 +44,7 @@ fatal:
 }
 static void term__exit_hook(void) {
   term__switch_raw_mode(STDIN_FILENO, 0);
-  write(STDOUT_FILENO, "\x1b[2J\x1b[H", 7);
+  write(STDOUT_FILENO, "\x1b[?2004l\x1b[0m\x1b[2J\x1b[H", 19);
 }
 static int term__get_point(int ifd, int ofd, struct point *point) {
     char buf[32];
@@ -63,7 +64,7 @@ static int term__get_point(int ifd, int ofd, struct point *point) {
 	sscanf(buf+2,"%d;%d",&(point->row),&(point->col)) == 2) return 0;
     else return -1;
 }
-static void term__handleSIGWINCH(int unused __attribute__((unused))) {
+static void term__get_winsize(void) {
     struct winsize ws;
     /* try to get via ioctl() */
     int got_winsize = !ioctl(1, TIOCGWINSZ, &ws) && ws.ws_col != 0;
@@ -96,32 +97,142 @@ static void term__handleSIGWINCH(int unused __attribute__((unused))) {
     E.terminal.winsize.row -= 2; /* room for status bar. */
     if (E.buffer.point.row > E.terminal.winsize.row) E.buffer.point.row = E.terminal.winsize.row - 1;
     if (E.buffer.point.col > E.terminal.winsize.col) E.buffer.point.col = E.terminal.winsize.col - 1;
-    editor_refresh();
 }
 
+/* SIGWINCH only pokes the self-pipe: the resize itself is handled by
+   term_read() like any other input, outside of signal context */
+static int winch_pipe[2] = {-1, -1};
+
+static void term__handleSIGWINCH(int unused __attribute__((unused))) {
+    int saved_errno = errno;
+    write(winch_pipe[1], "", 1);
+    errno = saved_errno;
+}
+
+/* Input is read as many bytes at a time as the terminal has ready */
+static unsigned char inbuf[4096];
+static int inpos, inlen;
+
+/* Descriptor that a worker thread writes to when done, or -1 */
+static int watch_fd = -1;
+
+/* Have term_read() return NOTIFY while <fd> is readable; draining it is
+   up to the caller */
+void term_watch(int fd) {
+    watch_fd = fd;
+}
+
+/* Sleep until the terminal has input (1), the window was resized (RESIZE),
+   the watched descriptor is readable (NOTIFY) or <timeout> ms passed (0);
+   a negative <timeout> waits forever */
+static int term__wait(int fd, int timeout) {
+    struct pollfd pfd[3] = {{fd, POLLIN, 0}, {winch_pipe[0], POLLIN, 0}, {watch_fd, POLLIN, 0}};
+    int n;
+    while ((n = poll(pfd,watch_fd == -1 ? 2 : 3,timeout)) == -1)
+        if (errno != EINTR) exit(1);
+    if (n == 0) return 0;
+    if (pfd[1].revents & POLLIN) {
+        char drain[64];
+        while (read(winch_pipe[0],drain,sizeof(drain)) > 0);
+        return RESIZE;
+    }
+    if (pfd[2].revents & POLLIN) return NOTIFY;
+    return 1;
+}
+
+/* Next input byte into *c: 1 if read, 0 if none came within <timeout> ms */
+static int term__getc(int fd, unsigned char *c, int timeout) {
+    if (inpos == inlen) {
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int n;
+        while ((n = poll(&pfd,1,timeout)) == -1)
+            if (errno != EINTR) exit(1);
+        if (n == 0) return 0;
+        inpos = 0;
+        inlen = read(fd,inbuf,sizeof(inbuf));
+        if (inlen <= 0) exit(1);
+    }
+    *c = inbuf[inpos++];
+    return 1;
+}
+
+/* The rest of an escape sequence is given this long to arrive */
+#define TERM_SEQ_TIMEOUT 100
+
+/* Is more input ready, so the screen can wait? */
+int term_pending(int fd) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    return inpos < inlen || poll(&pfd,1,0) > 0;
+}
+
+/* Text of the last PASTE, see term__read_paste() */
+static char *paste;
+static size_t pastelen, pastecap;
+
+char *term_paste(size_t *len) {
+    *len = pastelen;
+    return paste;
+}
+
+/* Collect a bracketed paste, up to the ESC [ 2 0 1 ~ that ends it */
+static void term__read_paste(int fd) {
+    static const char end[] = "\x1b[201~";
+    unsigned char c;
+    pastelen = 0;
+    while (pastelen < 6 || memcmp(paste+pastelen-6,end,6)) {
+        while (!term__getc(fd,&c,-1));
+        if (pastelen == pastecap) {
+            pastecap = pastecap ? pastecap*2 : 4096;
+            paste = realloc(paste,pastecap);
+        }
+        paste[pastelen++] = c;
+    }
+    pastelen -= 6;
+}
+
+/* Milliseconds until the echo area message is due to be cleared, or -1 */
+static int term__timeout(void) {
+    if (!E.statusmsg[0]) return -1;
+    if (time(NULL) > E.statusmsg_time + 2) return 0; /* as in editor_refresh() */
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME,&now);
+    long ms = (E.statusmsg_time+3 - now.tv_sec)*1000L - now.tv_nsec/1000000;
+    return ms > 0 ? ms : 10; /* time() may lag the clock by a tick */
+}
+
+/* Next key, sleeping until there is one.  Also returns RESIZE after the
+   window size changed, TIMER when the echo area message expires and
+   NOTIFY for term_watch(), so the caller redraws. */
 int term_read(int fd) {
     assert(E.terminal.rawmode);
-    int nread;
-    char c, seq[3];
-    while ((nread = read(fd,&c,1)) == 0);
-    if (nread == -1) exit(1);
+    unsigned char c, seq[3];
+    if (inpos == inlen) {
+        switch (term__wait(fd,term__timeout())) {
+        case 0: return TIMER;
+        case RESIZE: term__get_winsize(); return RESIZE;
+        case NOTIFY: return NOTIFY;
+        }
+    }
+    term__getc(fd,&c,-1);
 
     /* normal character */
     if (c != ESC) return c;
 
     /* just an ESC */
-    if (!read(fd,seq,1) || !read(fd,seq+1,1)) return ESC; 
+    if (!term__getc(fd,seq,TERM_SEQ_TIMEOUT) || !term__getc(fd,seq+1,TERM_SEQ_TIMEOUT)) return ESC; 
 
     /* esc seq */
     if (seq[0] == '[') {
       if (seq[1] >= '0' && seq[1] <= '9') {
-	/* DEL, PgUP, PgDn */
-	if (read(fd,seq+2,1) == 0) return ESC;
+	/* DEL, PgUP, PgDn, paste: ESC [ <n> ~ */
+	int n = seq[1]-'0';
+	while (term__getc(fd,seq+2,TERM_SEQ_TIMEOUT) && seq[2] >= '0' && seq[2] <= '9') n = n*10 + seq[2]-'0';
 	if (seq[2] == '~') {
-	  switch(seq[1]) {
-	  case '3': return CTRL_D;
-	  case '5': return PAGE_UP;
-	  case '6': return PAGE_DOWN;
+	  switch(n) {
+	  case 3: return CTRL_D;
+	  case 5: return PAGE_UP;
+	  case 6: return PAGE_DOWN;
+	  case 200: term__read_paste(fd); return PASTE;
 	  }
 	}
       } else {
@@ -149,7 +260,16 @@ int term_read(int fd) {
 }
 
 void term_setup(void) {
-    term__handleSIGWINCH(0);
+    term__get_winsize();
+    if (pipe(winch_pipe) == -1) {
+        perror("Unable to create pipe for SIGWINCH");
+        exit(1);
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(winch_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(winch_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
     signal(SIGWINCH, term__handleSIGWINCH);
     term__switch_raw_mode(STDIN_FILENO, 1);
+    write(STDOUT_FILENO, "\x1b[?2004h", 8); /* bracketed paste */
 }
@@ -1,3 +1,6 @@
 
 void term_setup(void);
 int term_read(int);
+int term_pending(int);
+char *term_paste(size_t *);
+void term_watch(int);
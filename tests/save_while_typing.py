@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+# Types into the editor while it saves a large file, on a pty.
+#
+#   tests/save_while_typing.py <editor built with -fsanitize=address>
+#
+# The same keys are typed in three runs:
+#   A: edits, Ctrl-S, more edits while the save runs, Ctrl-S again
+#   B: edits, Ctrl-S
+#   C: edits, more edits, Ctrl-S
+# The first save of A must match B (the lines as they were at Ctrl-S, not
+# as they are while it writes them) and the second must match C.  Any
+# report of AddressSanitizer fails the test too.
+
+import fcntl, os, pty, random, select, shutil, struct, sys, tempfile, termios, time
+
+LINES = 1000000
+
+def ctrl(c):
+    return bytes([ord(c) & 31])
+
+def keys(rnd, n):
+    ks = b''
+    for _ in range(n):
+        x = rnd.random()
+        if x < 0.4:   ks += bytes([rnd.choice(b'abcxyz ')])
+        elif x < 0.55: ks += ctrl('n')
+        elif x < 0.6:  ks += ctrl('p')
+        elif x < 0.7:  ks += b'\r'
+        elif x < 0.8:  ks += ctrl('h')
+        elif x < 0.85: ks += ctrl('k')
+        elif x < 0.9:  ks += ctrl('d')
+        else:          ks += ctrl('f')
+    return ks
+
+class Editor:
+    def __init__(self, binary, path, log):
+        self.out = b''
+        self.pid, self.fd = pty.fork()
+        if self.pid == 0:
+            fcntl.ioctl(0, termios.TIOCSWINSZ, struct.pack('HHHH', 24, 80, 0, 0))
+            os.dup2(os.open(log, os.O_WRONLY | os.O_CREAT | os.O_TRUNC), 2)
+            os.execv(binary, [binary, path])
+        if not self.wait(b' - ', 120):
+            sys.exit('%s: editor did not start' % path)
+        time.sleep(0.5)
+
+    def read(self, timeout):
+        r, _, _ = select.select([self.fd], [], [], timeout)
+        if r:
+            self.out += os.read(self.fd, 1 << 20)
+
+    def wait(self, pat, timeout):
+        end = time.time() + timeout
+        while pat not in self.out and time.time() < end:
+            self.read(0.01)
+        return pat in self.out
+
+    def send(self, ks):
+        for i in range(0, len(ks), 16):
+            os.write(self.fd, ks[i:i+16])
+            self.read(0.002)
+
+    def settle(self):
+        time.sleep(0.3)
+        self.read(0)
+        self.out = b''
+
+    def save(self, path, copy):
+        """Wait for the save started with Ctrl-S, and keep what it wrote"""
+        if not self.wait(b'bytes written', 300):
+            sys.exit('%s: save did not finish' % copy)
+        shutil.copy(path, copy)
+        self.settle()
+
+    def kill(self):
+        os.kill(self.pid, 9)
+        os.waitpid(self.pid, 0)
+
+def run(binary, dir, orig, name, ks1, ks2):
+    path = os.path.join(dir, name + '.txt')
+    log = os.path.join(dir, name + '.asan')
+    shutil.copy(orig, path)
+    ed = Editor(binary, path, log)
+    ed.send(ks1)
+    ed.settle()
+    saved = []
+    if name == 'A':
+        os.write(ed.fd, ctrl('s'))
+        ed.send(ks2)
+        if b'bytes written' in ed.out:
+            print('warning: the save finished before the typing did')
+        saved.append(os.path.join(dir, 'A1'))
+        ed.save(path, saved[-1])
+        os.write(ed.fd, ctrl('s'))
+        saved.append(os.path.join(dir, 'A2'))
+        ed.save(path, saved[-1])
+    else:
+        if name == 'C':
+            ed.send(ks2)
+            ed.settle()
+        os.write(ed.fd, ctrl('s'))
+        saved.append(os.path.join(dir, name))
+        ed.save(path, saved[-1])
+    ed.kill()
+    with open(log) as f:
+        report = f.read()
+    if report:
+        sys.exit('%s: AddressSanitizer:\n%s' % (name, report))
+    return saved
+
+def same(a, b):
+    with open(a, 'rb') as fa, open(b, 'rb') as fb:
+        return fa.read() == fb.read()
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit('usage: %s <editor>' % sys.argv[0])
+    binary = os.path.abspath(sys.argv[1])
+    rnd = random.Random(7)
+    ks1, ks2 = keys(rnd, 300), keys(rnd, 3000)
+    with tempfile.TemporaryDirectory() as dir:
+        orig = os.path.join(dir, 'orig')
+        with open(orig, 'w') as f:
+            for i in range(LINES):
+                f.write('line %d of the file being saved\n' % i)
+        a1, a2 = run(binary, dir, orig, 'A', ks1, ks2)
+        b, = run(binary, dir, orig, 'B', ks1, ks2)
+        c, = run(binary, dir, orig, 'C', ks1, ks2)
+        ok = True
+        if not same(a1, b):
+            print('FAIL: the save differs from the lines at Ctrl-S')
+            ok = False
+        if not same(a2, c):
+            print('FAIL: the save after typing differs from the lines typed')
+            ok = False
+        if same(a1, a2):
+            print('FAIL: the keys typed during the save changed nothing')
+            ok = False
+        if not ok:
+            sys.exit(1)
+        print('ok: saved while typing %d keys' % len(ks2))
+
+main()